@@ -0,0 +1,61 @@
+#include "alloc.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// below this, page tables are not worth the trouble
+#define BIG_ALLOC_THRESHOLD (4ull << 20)
+#define HUGE_PAGE_SIZE (2ull << 20)
+// keeps the returned pointer 64-byte aligned
+#define BIG_HEADER 64
+
+enum big_kind { BIG_MALLOC, BIG_MMAP, BIG_HUGETLB };
+
+struct big_header {
+  u64 mapped; // bytes mapped, header included
+  enum big_kind kind;
+};
+
+void* big_alloc(u64 size){
+  u64 total;
+  if ( __builtin_add_overflow(size, BIG_HEADER, &total) ) return NULL;
+
+  u8* base;
+  enum big_kind kind;
+  if ( total < BIG_ALLOC_THRESHOLD ){
+    base = aligned_alloc(BIG_HEADER, (total + BIG_HEADER - 1) & ~(u64)(BIG_HEADER - 1));
+    if ( base == NULL ) return NULL;
+    kind = BIG_MALLOC;
+  } else {
+#ifdef MAP_HUGETLB
+    if ( total <= UINT64_MAX - HUGE_PAGE_SIZE ){
+      u64 rounded = (total + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+      base = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if ( base != MAP_FAILED ){
+        total = rounded;
+        kind = BIG_HUGETLB;
+        goto done;
+      }
+    }
+#endif
+    // no reserved huge pages: regular mapping, let khugepaged back it with THP
+    base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( base == MAP_FAILED ) return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(base, total, MADV_HUGEPAGE);
+#endif
+    kind = BIG_MMAP;
+  }
+
+done:
+  *(struct big_header*)base = (struct big_header){total, kind};
+  return base + BIG_HEADER;
+}
+
+void big_free(void* ptr){
+  if ( ptr == NULL ) return;
+  u8* base = (u8*)ptr - BIG_HEADER;
+  struct big_header header = *(struct big_header*)base;
+  if ( header.kind == BIG_MALLOC ) free(base);
+  else munmap(base, header.mapped);
+}
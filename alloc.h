@@ -0,0 +1,16 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include "types.h"
+
+/*
+ * Allocator for whole-image buffers. Small requests go to malloc; large ones
+ * are mapped directly, backed by explicit huge pages (MAP_HUGETLB) when the
+ * system has some reserved and by transparent huge pages (MADV_HUGEPAGE)
+ * otherwise. Either way the result is 64-byte aligned and must be released
+ * with big_free(), never free().
+ */
+void* big_alloc(u64 size); // NULL on failure
+void big_free(void* ptr);
+
+#endif
@@ -0,0 +1,723 @@
+#define _GNU_SOURCE // struct statx
+#include "batch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <pretty.h>
+
+#include "alloc.h"
+#include "decode.h"
+#include "encode.h"
+#include "file.h"
+
+// registered buffers, files that do not fit use ordinary ones
+#define BATCH_SLOT_SIZE (1u << 20)
+// a single read or write never asks for more than this
+#define BATCH_MAX_IO (1u << 30)
+// caps the registered pool at 256 MiB whatever the depth and thread count,
+// jobs that find no free slot use ordinary buffers
+#define BATCH_MAX_SLOTS 256
+
+/* CPU SIDE, shared by both engines */
+
+// worst case output size, 0 when the input is not what `mode` expects
+static u64 output_bound(enum batch_mode mode, const u8 *in, u64 size) {
+  if (mode == BATCH_ENCODE) {
+    if (size < 3 || in[0] != 'P' || in[1] != '6' || in[2] != '\n')
+      return 0;
+    // 5 bytes per 3 byte pixel at worst, plus header and end marker
+    return size / 3 * 5 + 32;
+  }
+  u32 width, height;
+  u64 bytes;
+  if (size < QOI_MIN_SIZE || memcmp(in, "qoif", 4) != 0 ||
+      !qoi_read_header(in, size, &width, &height) ||
+      __builtin_mul_overflow((u64)width * height, 3, &bytes))
+    return 0;
+  return bytes + 32;
+}
+
+// `*out` is used as is when the caller set it, it must hold output_bound()
+static long convert(enum batch_mode mode, u8 *in, u64 size, u8 **out) {
+  if (mode == BATCH_ENCODE)
+    return encode_parallel(in, size, out, 1);
+  return decode(in, size, out);
+}
+
+/* FALLBACK ENGINE: blocking pread/pwrite on every thread */
+
+struct fallback {
+  const struct batch_job *jobs;
+  u32 count;
+  enum batch_mode mode;
+  u32 next;
+  u32 failed;
+};
+
+static bool write_all(const char *path, const u8 *data, u64 size) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    error("Failed to create %s: %s", path, strerror(errno));
+    return false;
+  }
+  u64 done = 0;
+  while (done < size) {
+    ssize_t n = pwrite(fd, data + done, size - done, done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  if (close(fd) != 0 || done < size) {
+    error("Failed to write %s", path);
+    return false;
+  }
+  return true;
+}
+
+static void *fallback_worker(void *arg) {
+  struct fallback *f = arg;
+  u32 k;
+  while ((k = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED)) < f->count) {
+    const struct batch_job *job = &f->jobs[k];
+    u8 *in, *out = NULL;
+    u64 size;
+    long len = -1;
+    if ((in = read_file(job->input, &size)) == NULL) {
+      error("Failed to read %s: %s", job->input, strerror(errno));
+    } else {
+      if (output_bound(f->mode, in, size) == 0)
+        error("%s is not a %s file", job->input,
+              f->mode == BATCH_ENCODE ? "P6" : "QOI");
+      else
+        len = convert(f->mode, in, size, &out);
+      big_free(in);
+    }
+    if (len < 0 || !write_all(job->output, out, len))
+      __atomic_fetch_add(&f->failed, 1, __ATOMIC_RELAXED);
+    big_free(out);
+  }
+  return NULL;
+}
+
+static u32 run_fallback(const struct batch_job *jobs, u32 count,
+                        const struct batch_opts *opts) {
+  struct fallback f = {jobs, count, opts->mode, 0, 0};
+  u32 threads = opts->threads;
+  pthread_t tids[threads];
+  // the calling thread drains the queue too, fewer helpers only cost time
+  u32 started = 1;
+  while (started < threads &&
+         pthread_create(&tids[started], NULL, fallback_worker, &f) == 0)
+    started++;
+  fallback_worker(&f);
+  for (u32 k = 1; k < started; k++)
+    pthread_join(tids[k], NULL);
+  return f.failed;
+}
+
+/* IO_URING ENGINE: raw syscalls, the calling thread owns the ring */
+
+struct uring {
+  int fd;
+  u32 entries;
+  u32 to_submit;
+  u32 *sq_head, *sq_tail, *sq_mask, *sq_array;
+  u32 *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  u64 sq_map_size, cq_map_size;
+};
+
+static bool uring_setup(struct uring *ring, u32 entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0)
+    return false;
+  ring->entries = p.sq_entries;
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+  ring->cq_map_size =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_map_size > ring->sq_map_size)
+    ring->sq_map_size = ring->cq_map_size;
+
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_map = single ? ring->sq_map
+                        : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring->fd,
+                               IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    int err = errno;
+    close(ring->fd);
+    errno = err;
+    return false;
+  }
+
+  u8 *sq = ring->sq_map, *cq = ring->cq_map;
+  ring->sq_head = (u32 *)(sq + p.sq_off.head);
+  ring->sq_tail = (u32 *)(sq + p.sq_off.tail);
+  ring->sq_mask = (u32 *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (u32 *)(sq + p.sq_off.array);
+  ring->cq_head = (u32 *)(cq + p.cq_off.head);
+  ring->cq_tail = (u32 *)(cq + p.cq_off.tail);
+  ring->cq_mask = (u32 *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return true;
+}
+
+static void uring_close(struct uring *ring) {
+  munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+  if (ring->cq_map != ring->sq_map)
+    munmap(ring->cq_map, ring->cq_map_size);
+  munmap(ring->sq_map, ring->sq_map_size);
+  close(ring->fd);
+}
+
+// asks the kernel which opcodes the ring takes, false when any of `ops` is
+// missing or the kernel is too old to answer (the probe came with 5.6)
+static bool uring_supports(const struct uring *ring, const u8 *ops, u32 n) {
+  u32 probe_size = sizeof(struct io_uring_probe) +
+                   IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_size);
+  if (probe == NULL)
+    return false;
+  bool ok = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                    probe, IORING_OP_LAST) == 0;
+  for (u32 k = 0; ok && k < n; k++)
+    ok = ops[k] <= probe->last_op &&
+         (probe->ops[ops[k]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+// registered buffers are pinned against RLIMIT_MEMLOCK, a pool past it could
+// never be registered; only half is used, older kernels charge the ring too
+static u32 pool_slots(u32 wanted) {
+  struct rlimit lim;
+  if (geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &lim) == 0 &&
+      lim.rlim_cur != RLIM_INFINITY) {
+    u64 budget = lim.rlim_cur / 2 / BATCH_SLOT_SIZE;
+    wanted = budget < wanted ? budget : wanted;
+  }
+  return wanted;
+}
+
+// submits everything queued and, with `wait`, blocks for a completion
+static void uring_enter(struct uring *ring, bool wait) {
+  int n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0,
+                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (n > 0)
+    ring->to_submit -= n;
+  else if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    error("io_uring_enter failed: %s", strerror(errno));
+}
+
+static void uring_push(struct uring *ring, const struct io_uring_sqe *sqe) {
+  u32 tail = *ring->sq_tail;
+  while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+         ring->entries)
+    uring_enter(ring, false);
+  u32 idx = tail & *ring->sq_mask;
+  ring->sqes[idx] = *sqe;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+enum op_kind { OP_OPEN_IN, OP_STATX, OP_READ, OP_OPEN_OUT, OP_WRITE, OP_CLOSE, OP_EVENT };
+
+#define user_data(job, op) ((u64)(job) << 8 | (op))
+#define NO_JOB 0xFFFFFFFFu
+
+struct job {
+  const struct batch_job *spec;
+  int fd;
+  int in_slot, out_slot; // registered buffer index or -1
+  u8 *in, *out;
+  u64 in_size;
+  long out_len;
+  u64 done;   // bytes read or written so far
+  u8 pending; // open and statx still in flight
+  bool failed;
+  struct statx stx;
+  u32 next; // CPU queue link
+};
+
+struct engine {
+  struct uring ring;
+  struct job *jobs;
+  enum batch_mode mode;
+  u32 depth;
+
+  // registered buffer pool, the free stack is shared with the workers
+  u8 *pool;
+  u32 slots;
+  u32 *free_slots;
+  u32 n_free;
+  bool fixed; // the pool is registered with the ring
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  u32 todo_head, todo_tail; // read, waiting for a worker
+  u32 done_head;            // converted, waiting to be written
+  bool stopping;
+  int event_fd; // workers poke the ring through it
+  u64 event_value;
+
+  u32 reads, writes; // in flight
+  u32 active;        // started and not finished
+  u32 finished;
+  u32 failed;
+};
+
+static int take_slot(struct engine *e, u64 size) {
+  if (size > BATCH_SLOT_SIZE)
+    return -1;
+  pthread_mutex_lock(&e->lock);
+  int slot = e->n_free ? (int)e->free_slots[--e->n_free] : -1;
+  pthread_mutex_unlock(&e->lock);
+  return slot;
+}
+
+static void release_slot(struct engine *e, int slot) {
+  if (slot < 0)
+    return;
+  pthread_mutex_lock(&e->lock);
+  e->free_slots[e->n_free++] = slot;
+  pthread_mutex_unlock(&e->lock);
+}
+
+static u8 *slot_data(struct engine *e, int slot) {
+  return e->pool + (u64)slot * BATCH_SLOT_SIZE;
+}
+
+static void *engine_worker(void *arg) {
+  struct engine *e = arg;
+  pthread_mutex_lock(&e->lock);
+  for (;;) {
+    while (e->todo_head == NO_JOB && !e->stopping)
+      pthread_cond_wait(&e->cond, &e->lock);
+    if (e->todo_head == NO_JOB)
+      break;
+    u32 k = e->todo_head;
+    e->todo_head = e->jobs[k].next;
+    pthread_mutex_unlock(&e->lock);
+
+    struct job *job = &e->jobs[k];
+    u64 bound = output_bound(e->mode, job->in, job->in_size);
+    if (bound == 0) {
+      error("%s is not a %s file", job->spec->input,
+            e->mode == BATCH_ENCODE ? "P6" : "QOI");
+      job->out_len = -1;
+    } else {
+      job->out_slot = take_slot(e, bound);
+      job->out = job->out_slot >= 0 ? slot_data(e, job->out_slot) : NULL;
+      job->out_len = convert(e->mode, job->in, job->in_size, &job->out);
+    }
+
+    pthread_mutex_lock(&e->lock);
+    job->next = e->done_head;
+    e->done_head = k;
+    pthread_mutex_unlock(&e->lock);
+    u64 one = 1;
+    if (write(e->event_fd, &one, sizeof(one)) < 0)
+      error("Failed to wake the I/O thread: %s", strerror(errno));
+    pthread_mutex_lock(&e->lock);
+  }
+  pthread_mutex_unlock(&e->lock);
+  return NULL;
+}
+
+static void push_close(struct engine *e, u32 k) {
+  struct job *job = &e->jobs[k];
+  if (job->fd < 0)
+    return;
+  uring_push(&e->ring, &(struct io_uring_sqe){.opcode = IORING_OP_CLOSE,
+                                              .fd = job->fd,
+                                              .user_data =
+                                                  user_data(k, OP_CLOSE)});
+  job->fd = -1;
+}
+
+// next chunk of the read or write in progress, from a registered buffer when
+// the job has one
+static void push_rw(struct engine *e, u32 k, bool is_write) {
+  struct job *job = &e->jobs[k];
+  u8 *buf = is_write ? job->out : job->in;
+  u64 size = is_write ? (u64)job->out_len : job->in_size;
+  int slot = is_write ? job->out_slot : job->in_slot;
+  u64 len = size - job->done;
+  struct io_uring_sqe sqe = {
+      .fd = job->fd,
+      .addr = (u64)(uintptr_t)(buf + job->done),
+      .len = len > BATCH_MAX_IO ? BATCH_MAX_IO : len,
+      .off = job->done,
+      .user_data = user_data(k, is_write ? OP_WRITE : OP_READ)};
+  if (e->fixed && slot >= 0) {
+    sqe.opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe.buf_index = slot;
+  } else {
+    sqe.opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  uring_push(&e->ring, &sqe);
+}
+
+static void start_read(struct engine *e, u32 k) {
+  struct job *job = &e->jobs[k];
+  job->pending = 2;
+  uring_push(&e->ring,
+             &(struct io_uring_sqe){.opcode = IORING_OP_OPENAT,
+                                    .fd = AT_FDCWD,
+                                    .addr = (u64)(uintptr_t)job->spec->input,
+                                    .open_flags = O_RDONLY,
+                                    .user_data = user_data(k, OP_OPEN_IN)});
+  uring_push(&e->ring,
+             &(struct io_uring_sqe){.opcode = IORING_OP_STATX,
+                                    .fd = AT_FDCWD,
+                                    .addr = (u64)(uintptr_t)job->spec->input,
+                                    .len = STATX_SIZE,
+                                    .off = (u64)(uintptr_t)&job->stx,
+                                    .user_data = user_data(k, OP_STATX)});
+  e->reads++;
+  e->active++;
+}
+
+static void start_write(struct engine *e, u32 k) {
+  struct job *job = &e->jobs[k];
+  job->done = 0;
+  uring_push(&e->ring,
+             &(struct io_uring_sqe){.opcode = IORING_OP_OPENAT,
+                                    .fd = AT_FDCWD,
+                                    .addr = (u64)(uintptr_t)job->spec->output,
+                                    .open_flags =
+                                        O_WRONLY | O_CREAT | O_TRUNC,
+                                    .len = 0644,
+                                    .user_data = user_data(k, OP_OPEN_OUT)});
+  e->writes++;
+}
+
+static void finish(struct engine *e, u32 k) {
+  struct job *job = &e->jobs[k];
+  push_close(e, k);
+  if (job->in_slot >= 0)
+    release_slot(e, job->in_slot);
+  else
+    big_free(job->in);
+  if (job->out_slot >= 0)
+    release_slot(e, job->out_slot);
+  else
+    big_free(job->out);
+  job->in = job->out = NULL;
+  job->in_slot = job->out_slot = -1;
+  e->failed += job->failed;
+  e->finished++;
+  e->active--;
+}
+
+static void read_done(struct engine *e, u32 k) {
+  struct job *job = &e->jobs[k];
+  e->reads--;
+  if (job->failed) {
+    finish(e, k);
+    return;
+  }
+  push_close(e, k);
+  pthread_mutex_lock(&e->lock);
+  job->next = NO_JOB;
+  if (e->todo_head == NO_JOB)
+    e->todo_head = k;
+  else
+    e->jobs[e->todo_tail].next = k;
+  e->todo_tail = k;
+  pthread_cond_signal(&e->cond);
+  pthread_mutex_unlock(&e->lock);
+}
+
+static void complete(struct engine *e, u64 data, i32 res) {
+  u32 k = data >> 8;
+  enum op_kind op = data & 0xFF;
+  struct job *job = &e->jobs[k];
+
+  switch (op) {
+  case OP_OPEN_IN:
+  case OP_STATX:
+    if (res < 0) {
+      // openat and statx usually fail together, say it once
+      if (!job->failed)
+        error("Failed to open %s: %s", job->spec->input, strerror(-res));
+      job->failed = true;
+    } else if (op == OP_OPEN_IN) {
+      job->fd = res;
+    }
+    if (--job->pending > 0)
+      return;
+    if (job->failed) {
+      read_done(e, k);
+      return;
+    }
+    job->in_size = job->stx.stx_size;
+    job->in_slot = take_slot(e, job->in_size);
+    job->in = job->in_slot >= 0 ? slot_data(e, job->in_slot)
+                                : big_alloc(job->in_size ? job->in_size : 1);
+    job->done = 0;
+    if (job->in == NULL || job->in_size == 0) {
+      error("Failed to read %s", job->spec->input);
+      job->failed = true;
+      read_done(e, k);
+      return;
+    }
+    push_rw(e, k, false);
+    return;
+
+  case OP_READ:
+    if (res <= 0) {
+      error("Failed to read %s: %s", job->spec->input,
+            res < 0 ? strerror(-res) : "file shrank");
+      job->failed = true;
+      read_done(e, k);
+      return;
+    }
+    job->done += res;
+    if (job->done < job->in_size)
+      push_rw(e, k, false);
+    else
+      read_done(e, k);
+    return;
+
+  case OP_OPEN_OUT:
+    if (res < 0) {
+      error("Failed to create %s: %s", job->spec->output, strerror(-res));
+      job->failed = true;
+      e->writes--;
+      finish(e, k);
+      return;
+    }
+    job->fd = res;
+    if (job->out_len == 0) {
+      e->writes--;
+      finish(e, k);
+      return;
+    }
+    push_rw(e, k, true);
+    return;
+
+  case OP_WRITE:
+    if (res <= 0) {
+      error("Failed to write %s: %s", job->spec->output,
+            res < 0 ? strerror(-res) : "no progress");
+      job->failed = true;
+    } else {
+      job->done += res;
+      if (job->done < (u64)job->out_len) {
+        push_rw(e, k, true);
+        return;
+      }
+    }
+    e->writes--;
+    finish(e, k);
+    return;
+
+  case OP_EVENT:
+    uring_push(&e->ring,
+               &(struct io_uring_sqe){.opcode = IORING_OP_READ,
+                                      .fd = e->event_fd,
+                                      .addr = (u64)(uintptr_t)&e->event_value,
+                                      .len = sizeof(e->event_value),
+                                      .off = -1,
+                                      .user_data = user_data(0, OP_EVENT)});
+    return;
+
+  case OP_CLOSE:
+    return;
+  }
+}
+
+// `*setup_error` is the errno that kept the engine from starting, 0 once it ran
+static u32 run_uring(const struct batch_job *specs, u32 count,
+                     const struct batch_opts *opts, int *setup_error) {
+  struct engine e;
+  memset(&e, 0, sizeof(e));
+  e.mode = opts->mode;
+  e.depth = opts->io_depth;
+  u32 threads = opts->threads;
+
+  // every job in flight owns at most two ops plus a close, the ring is sized
+  // so completions never overflow
+  if (!uring_setup(&e.ring, 8 * e.depth + 8)) {
+    *setup_error = errno;
+    return 0;
+  }
+  // a ring that accepts none of these fails every job, the plain engine does not
+  static const u8 needed[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                              IORING_OP_WRITE, IORING_OP_CLOSE};
+  static const u8 fixed_ops[] = {IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED};
+  if (!uring_supports(&e.ring, needed, sizeof(needed))) {
+    uring_close(&e.ring);
+    *setup_error = EOPNOTSUPP;
+    return 0;
+  }
+  e.event_fd = eventfd(0, EFD_CLOEXEC);
+
+  // enough slots for the input and output of every job that can be active
+  u32 max_active = 2 * e.depth + threads;
+  e.slots = pool_slots(2 * max_active < BATCH_MAX_SLOTS ? 2 * max_active
+                                                        : BATCH_MAX_SLOTS);
+  e.jobs = calloc(count, sizeof(struct job));
+  struct iovec *iov = NULL;
+  if (e.slots > 0) {
+    e.pool = big_alloc((u64)e.slots * BATCH_SLOT_SIZE);
+    e.free_slots = calloc(e.slots, sizeof(u32));
+    iov = calloc(e.slots, sizeof(struct iovec));
+  }
+  if (e.event_fd < 0 || e.jobs == NULL ||
+      (e.slots > 0 &&
+       (e.pool == NULL || e.free_slots == NULL || iov == NULL))) {
+    error("Failed to set up the io_uring engine");
+    exit(1);
+  }
+  for (u32 s = 0; s < e.slots; s++) {
+    iov[s] = (struct iovec){slot_data(&e, s), BATCH_SLOT_SIZE};
+    e.free_slots[e.n_free++] = e.slots - 1 - s;
+  }
+  // with no slots every job uses ordinary buffers
+  if (e.slots > 0) {
+    bool fixed_ops_ok = uring_supports(&e.ring, fixed_ops, sizeof(fixed_ops));
+    e.fixed = fixed_ops_ok &&
+              syscall(__NR_io_uring_register, e.ring.fd,
+                      IORING_REGISTER_BUFFERS, iov, e.slots) == 0;
+    if (!e.fixed)
+      info("io_uring: could not register buffers (%s), using plain reads",
+           fixed_ops_ok ? strerror(errno) : "fixed reads not supported");
+  }
+  free(iov);
+
+  for (u32 k = 0; k < count; k++)
+    e.jobs[k] = (struct job){.spec = &specs[k],
+                             .fd = -1,
+                             .in_slot = -1,
+                             .out_slot = -1,
+                             .next = NO_JOB};
+  e.todo_head = e.done_head = NO_JOB;
+  pthread_mutex_init(&e.lock, NULL);
+  pthread_cond_init(&e.cond, NULL);
+  pthread_t tids[threads];
+  u32 started = 0;
+  int err = 0;
+  while (started < threads &&
+         (err = pthread_create(&tids[started], NULL, engine_worker, &e)) == 0)
+    started++;
+  // nothing was submitted yet, without a converter the plain engine takes over
+  if (started == 0) {
+    uring_close(&e.ring);
+    close(e.event_fd);
+    pthread_cond_destroy(&e.cond);
+    pthread_mutex_destroy(&e.lock);
+    big_free(e.pool);
+    free(e.free_slots);
+    free(e.jobs);
+    *setup_error = err;
+    return 0;
+  }
+  *setup_error = 0;
+
+  complete(&e, user_data(0, OP_EVENT), 0); // arms the eventfd read
+  u32 next = 0;
+  while (e.finished < count) {
+    while (next < count && e.reads < e.depth && e.active < max_active)
+      start_read(&e, next++);
+
+    // converted jobs go out as write slots free up, oldest last is fine
+    pthread_mutex_lock(&e.lock);
+    u32 ready = e.done_head;
+    e.done_head = NO_JOB;
+    pthread_mutex_unlock(&e.lock);
+    while (ready != NO_JOB) {
+      u32 k = ready;
+      ready = e.jobs[k].next;
+      if (e.jobs[k].out_len < 0) {
+        e.jobs[k].failed = true;
+        finish(&e, k);
+      } else if (e.writes < e.depth) {
+        start_write(&e, k);
+      } else {
+        pthread_mutex_lock(&e.lock);
+        e.jobs[k].next = e.done_head;
+        e.done_head = k;
+        pthread_mutex_unlock(&e.lock);
+      }
+    }
+    if (e.finished == count)
+      break;
+
+    uring_enter(&e.ring, true);
+    u32 head = *e.ring.cq_head;
+    u32 tail = __atomic_load_n(e.ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &e.ring.cqes[head & *e.ring.cq_mask];
+      complete(&e, cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(e.ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  // the closes queued by the last jobs
+  uring_enter(&e.ring, false);
+
+  pthread_mutex_lock(&e.lock);
+  e.stopping = true;
+  pthread_cond_broadcast(&e.cond);
+  pthread_mutex_unlock(&e.lock);
+  for (u32 t = 0; t < started; t++)
+    pthread_join(tids[t], NULL);
+
+  uring_close(&e.ring);
+  close(e.event_fd);
+  pthread_cond_destroy(&e.cond);
+  pthread_mutex_destroy(&e.lock);
+  big_free(e.pool);
+  free(e.free_slots);
+  free(e.jobs);
+  return e.failed;
+}
+
+u32 batch_run(const struct batch_job *jobs, u32 count,
+              const struct batch_opts *opts) {
+  // both engines size their thread arrays and buffers from these
+  struct batch_opts o = *opts;
+  o.threads = o.threads == 0 ? 1
+              : o.threads > ENCODE_MAX_THREADS ? ENCODE_MAX_THREADS
+                                               : o.threads;
+  o.io_depth = o.io_depth == 0 ? 1
+               : o.io_depth > BATCH_MAX_IO_DEPTH ? BATCH_MAX_IO_DEPTH
+                                                 : o.io_depth;
+  if (o.io_uring) {
+    int setup_error;
+    u32 failed = run_uring(jobs, count, &o, &setup_error);
+    if (setup_error == 0)
+      return failed;
+    info("io_uring unavailable (%s), falling back to pread/pwrite",
+         strerror(setup_error));
+  }
+  return run_fallback(jobs, count, &o);
+}
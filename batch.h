@@ -0,0 +1,31 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+
+#include "types.h"
+
+// largest io_depth batch_run() honours, deeper requests are clamped
+#define BATCH_MAX_IO_DEPTH 1024
+
+enum batch_mode { BATCH_ENCODE, BATCH_DECODE };
+
+struct batch_job {
+  const char *input;
+  const char *output;
+};
+
+struct batch_opts {
+  enum batch_mode mode;
+  u32 threads;   // encoder/decoder threads, I/O stays on the calling thread,
+                 // clamped to ENCODE_MAX_THREADS
+  u32 io_depth;  // reads and writes each kept in flight
+  bool io_uring; // false forces the pread/pwrite engine
+};
+
+// converts every job, all file I/O goes through io_uring when the kernel
+// allows it, returns the number of jobs that failed
+u32 batch_run(const struct batch_job *jobs, u32 count,
+              const struct batch_opts *opts);
+
+#endif
@@ -1,16 +1,51 @@
 
 #include <argp.h>
 #include <pretty.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "alloc.h"
+#include "batch.h"
 #include "decode.h"
 #include "encode.h"
+#include "file.h"
+#include "pack.h"
+#include "tensor.h"
 #include "viewer.h"
+#include "watch.h"
+
+enum command_type {
+  CMD_NONE,
+  CMD_ENCODE,
+  CMD_DECODE,
+  CMD_DISPLAY,
+  CMD_PACK,
+  CMD_UNPACK,
+  CMD_WATCH
+};
 
-enum command_type { CMD_NONE, CMD_ENCODE, CMD_DECODE, CMD_DISPLAY };
+#define OPT_NEAR_LOSSLESS 0x100
+#define OPT_TENSOR 0x101
+#define OPT_LAYOUT 0x102
+#define OPT_MEAN 0x103
+#define OPT_STD 0x104
+#define OPT_LINEAR 0x105
+#define OPT_DEBOUNCE 0x106
+#define OPT_STATS 0x107
+#define OPT_RAW 0x108
+#define OPT_CROP 0x109
+#define OPT_MANIFEST 0x10A
+#define OPT_IO_DEPTH 0x10B
+#define OPT_NO_IO_URING 0x10C
 
 enum display_format {
   DISPLAY_PPM_P6,
@@ -23,17 +58,90 @@ struct arguments {
   char *input;
   char *output;
   enum display_format display_fmt;
+  char *name;   // image inside a pack file
+  char **files; // extra positional inputs for display and pack
+  int n_files;
+  unsigned prefetch;
+  unsigned cache_mib;
+  int near_lossless; // per-channel tolerance, -1 for lossless
+  unsigned threads;
+  bool tensor; // decode to a float tensor instead of P6
+  struct tensor_opts tensor_opts;
+  unsigned debounce_ms;
+  unsigned stats_s;
+  bool raw; // encode a headerless framebuffer dump
+  u32 raw_width;
+  u32 raw_height;
+  enum raw_format raw_format;
+  bool crop; // decode only the crop_rect region
+  u32 crop_rect[4]; // x, y, w, h
+  char **inputs; // every -i, several of them make a batch with the -o's
+  char **outputs;
+  int n_inputs;
+  int n_outputs;
+  char *manifest; // batch of INPUT OUTPUT lines
+  unsigned io_depth;
+  bool io_uring;
 };
 
 static char doc[] = "qoi-tool -- encode and decode QOI images";
 
-static char args_doc[] = "encode|decode";
+static char args_doc[] =
+    "encode|decode|display|pack|unpack|watch [FILE|DIR...]";
 
 static struct argp_option options[] = {
     {"input", 'i', "FILE", 0, "Input file (required)", 0},
     {"output", 'o', "FILE", 0, "Output file (optional, default stdout)", 0},
     {"ppm", 0, 0, OPTION_ALIAS, 0, 0},
     {"qoi", 0, 0, OPTION_ALIAS, 0, 0},
+    {"near-lossless", OPT_NEAR_LOSSLESS, "N", 0,
+     "Encode with every channel within N of the source (0-255), trading "
+     "exactness for runs and index hits",
+     0},
+    {"threads", 't', "N", 0,
+     "Encode with N threads, the output is identical to the serial encoder",
+     0},
+    {"raw", OPT_RAW, "WxH:FORMAT", 0,
+     "Encode a headerless framebuffer of rgb, bgra or bgrx pixels, padded "
+     "rows are detected from the file size",
+     0},
+    {"crop", OPT_CROP, "X,Y,W,H", 0,
+     "Decode only the WxH region at X,Y, the rest of the stream is skipped",
+     0},
+    {"tensor", OPT_TENSOR, "TYPE", 0,
+     "Decode to a raw f32 or f16 tensor instead of P6", 0},
+    {"layout", OPT_LAYOUT, "LAYOUT", 0,
+     "Tensor layout: chw (planar, default) or hwc (interleaved)", 0},
+    {"mean", OPT_MEAN, "R,G,B", 0,
+     "Per-channel mean subtracted from the [0,1] tensor values", 0},
+    {"std", OPT_STD, "R,G,B", 0,
+     "Per-channel standard deviation the tensor values are divided by", 0},
+    {"linear", OPT_LINEAR, 0, 0,
+     "Convert sRGB to linear light before normalizing the tensor", 0},
+    {"debounce", OPT_DEBOUNCE, "MS", 0,
+     "watch: quiet time after the last write before a file is encoded "
+     "(default 50)",
+     0},
+    {"stats", OPT_STATS, "SECONDS", 0,
+     "watch: print queue and latency stats this often, 0 to disable "
+     "(default 10)",
+     0},
+    {"manifest", OPT_MANIFEST, "FILE", 0,
+     "Convert every INPUT OUTPUT pair listed in FILE, one per line", 0},
+    {"io-depth", OPT_IO_DEPTH, "N", 0,
+     "Batch conversion: reads and writes each kept in flight (default 32)",
+     0},
+    {"no-io-uring", OPT_NO_IO_URING, 0, 0,
+     "Batch conversion: use pread/pwrite instead of io_uring", 0},
+    {"name", 'n', "NAME", 0,
+     "Image to decode when the input is a pack file", 0},
+    {"prefetch", 'p', "N", 0,
+     "Images decoded ahead on each side when displaying several files "
+     "(default 2)",
+     0},
+    {"cache", 'c', "MIB", 0,
+     "Texture cache budget in MiB when displaying several files (default 512)",
+     0},
     {0}};
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -42,22 +150,147 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   switch (key) {
 
   case ARGP_KEY_ARG:
-    if (strcmp(arg, "encode") == 0)
+    if (arguments->cmd == CMD_DISPLAY || arguments->cmd == CMD_PACK ||
+        (arguments->cmd == CMD_WATCH && arguments->n_files == 0))
+      arguments->files[arguments->n_files++] = arg;
+    else if (arguments->cmd != CMD_NONE)
+      argp_usage(state);
+    else if (strcmp(arg, "encode") == 0)
       arguments->cmd = CMD_ENCODE;
     else if (strcmp(arg, "decode") == 0)
       arguments->cmd = CMD_DECODE;
     else if (strcmp(arg, "display") == 0)
       arguments->cmd = CMD_DISPLAY;
+    else if (strcmp(arg, "pack") == 0)
+      arguments->cmd = CMD_PACK;
+    else if (strcmp(arg, "unpack") == 0)
+      arguments->cmd = CMD_UNPACK;
+    else if (strcmp(arg, "watch") == 0)
+      arguments->cmd = CMD_WATCH;
     else
       argp_usage(state);
     break;
 
   case 'i':
     arguments->input = arg;
+    arguments->inputs[arguments->n_inputs++] = arg;
     break;
 
   case 'o':
     arguments->output = arg;
+    arguments->outputs[arguments->n_outputs++] = arg;
+    break;
+
+  case OPT_MANIFEST:
+    arguments->manifest = arg;
+    break;
+
+  case OPT_IO_DEPTH:
+    arguments->io_depth = strtoul(arg, NULL, 10);
+    if (arguments->io_depth == 0 || arguments->io_depth > BATCH_MAX_IO_DEPTH)
+      argp_error(state, "Invalid I/O depth: %s (1-%d)", arg,
+                 BATCH_MAX_IO_DEPTH);
+    break;
+
+  case OPT_NO_IO_URING:
+    arguments->io_uring = false;
+    break;
+
+  case 'n':
+    arguments->name = arg;
+    break;
+
+  case OPT_NEAR_LOSSLESS: {
+    char *end;
+    long n = strtol(arg, &end, 10);
+    if (*end || n < 0 || n > 255)
+      argp_error(state, "Invalid near-lossless tolerance: %s", arg);
+    arguments->near_lossless = n;
+    break;
+  }
+
+  case OPT_RAW: {
+    char format[8];
+    if (sscanf(arg, "%ux%u:%7s", &arguments->raw_width,
+               &arguments->raw_height, format) != 3)
+      argp_error(state, "Invalid raw layout %s, expected WxH:FORMAT", arg);
+    if (strcmp(format, "rgb") == 0)
+      arguments->raw_format = RAW_RGB;
+    else if (strcmp(format, "bgra") == 0)
+      arguments->raw_format = RAW_BGRA;
+    else if (strcmp(format, "bgrx") == 0)
+      arguments->raw_format = RAW_BGRX;
+    else
+      argp_error(state, "Invalid raw format. Use: rgb, bgra or bgrx");
+    arguments->raw = true;
+    break;
+  }
+
+  case OPT_CROP: {
+    u32 *r = arguments->crop_rect;
+    if (sscanf(arg, "%u,%u,%u,%u", &r[0], &r[1], &r[2], &r[3]) != 4 ||
+        r[2] == 0 || r[3] == 0)
+      argp_error(state, "Invalid crop rectangle: %s", arg);
+    arguments->crop = true;
+    break;
+  }
+
+  case OPT_TENSOR:
+    arguments->tensor = true;
+    if (strcmp(arg, "f32") == 0)
+      arguments->tensor_opts.dtype = TENSOR_F32;
+    else if (strcmp(arg, "f16") == 0)
+      arguments->tensor_opts.dtype = TENSOR_F16;
+    else
+      argp_error(state, "Invalid tensor type. Use: f32 or f16");
+    break;
+
+  case OPT_LAYOUT:
+    if (strcmp(arg, "chw") == 0)
+      arguments->tensor_opts.layout = TENSOR_CHW;
+    else if (strcmp(arg, "hwc") == 0)
+      arguments->tensor_opts.layout = TENSOR_HWC;
+    else
+      argp_error(state, "Invalid tensor layout. Use: chw or hwc");
+    break;
+
+  case OPT_MEAN:
+  case OPT_STD: {
+    float *v = key == OPT_MEAN ? arguments->tensor_opts.mean
+                               : arguments->tensor_opts.std;
+    if (sscanf(arg, "%f,%f,%f", &v[0], &v[1], &v[2]) != 3 ||
+        (key == OPT_STD && (v[0] == 0 || v[1] == 0 || v[2] == 0)))
+      argp_error(state, "Invalid per-channel values: %s", arg);
+    break;
+  }
+
+  case OPT_DEBOUNCE:
+    arguments->debounce_ms = strtoul(arg, NULL, 10);
+    break;
+
+  case OPT_STATS:
+    arguments->stats_s = strtoul(arg, NULL, 10);
+    break;
+
+  case OPT_LINEAR:
+    arguments->tensor_opts.srgb_to_linear = true;
+    break;
+
+  case 't':
+    arguments->threads = strtoul(arg, NULL, 10);
+    if (arguments->threads == 0 || arguments->threads > ENCODE_MAX_THREADS)
+      argp_error(state, "Invalid thread count: %s (1-%d)", arg,
+                 ENCODE_MAX_THREADS);
+    break;
+
+  case 'p':
+    arguments->prefetch = strtoul(arg, NULL, 10);
+    break;
+
+  case 'c':
+    arguments->cache_mib = strtoul(arg, NULL, 10);
+    if (arguments->cache_mib == 0)
+      argp_error(state, "Invalid cache budget: %s", arg);
     break;
 
   case 'f':
@@ -73,16 +306,38 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
   case ARGP_KEY_END:
     if (arguments->cmd == CMD_NONE)
-      argp_error(state, "Missing subcommand: encode|decode|display");
+      argp_error(
+          state,
+          "Missing subcommand: encode|decode|display|pack|unpack|watch");
 
-    if (!arguments->input)
+    if (!arguments->input && arguments->n_files == 0 && !arguments->manifest)
       argp_error(state, "Missing required -i/--input FILE");
 
+    if (arguments->manifest && (arguments->n_inputs || arguments->n_outputs))
+      argp_error(state, "--manifest cannot be combined with -i/-o");
+
+    if (arguments->n_inputs > 1 || arguments->manifest) {
+      if (arguments->cmd != CMD_ENCODE && arguments->cmd != CMD_DECODE)
+        argp_error(state, "Several inputs are only supported by encode and "
+                          "decode");
+      if (arguments->n_inputs != arguments->n_outputs)
+        argp_error(state, "Every -i needs its own -o");
+      if (arguments->tensor || arguments->crop || arguments->raw ||
+          arguments->name || arguments->near_lossless >= 0)
+        argp_error(state, "Batch conversion only does plain encode/decode");
+    }
+
+    if (arguments->raw && arguments->near_lossless >= 0)
+      argp_error(state, "--raw cannot be combined with --near-lossless");
+
+    if (arguments->crop && arguments->tensor)
+      argp_error(state, "--crop cannot be combined with --tensor");
+
     if (!arguments->display_fmt)
       arguments->display_fmt = DISPLAY_AUTO;
 
     // Set default display format if not specified
-    if (arguments->cmd == CMD_DISPLAY &&
+    if (arguments->cmd == CMD_DISPLAY && arguments->input &&
         arguments->display_fmt == DISPLAY_AUTO) {
       // Auto-detect based on file extension
       const char *ext = strrchr(arguments->input, '.');
@@ -103,27 +358,314 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = {options, parse_opt, args_doc, doc, 0, NULL, NULL};
 
+static bool is_image_name(const char *name) {
+  const char *ext = strrchr(name, '.');
+  return ext && (strcmp(ext, ".qoi") == 0 || strcmp(ext, ".ppm") == 0 ||
+                 strcmp(ext, ".p6") == 0);
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void push_path(char ***list, u32 *count, u32 *cap, char *path) {
+  if (*count == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    *list = realloc(*list, *cap * sizeof(char *));
+  }
+  (*list)[(*count)++] = path;
+}
+
+/* Expands directories into their QOI/PPM entries (sorted by name), plain
+ * files are kept in command line order. Every returned path is heap owned. */
+static void collect_images(char *path, char ***list, u32 *count, u32 *cap) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "Failed to open input file: %s\n", path);
+    exit(1);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    push_path(list, count, cap, strdup(path));
+    return;
+  }
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "Failed to open input directory: %s\n", path);
+    exit(1);
+  }
+  u32 first = *count;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.' || !is_image_name(entry->d_name))
+      continue;
+    char *full = malloc(strlen(path) + strlen(entry->d_name) + 2);
+    sprintf(full, "%s/%s", path, entry->d_name);
+    push_path(list, count, cap, full);
+  }
+  closedir(dir);
+  qsort(*list + first, *count - first, sizeof(char *), compare_paths);
+}
+
+static bool is_directory(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static u8 *read_input(const char *path, long *size) {
+  u64 len;
+  u8 *buffer = read_file(path, &len);
+  if (!buffer) {
+    fprintf(stderr, "Failed to read input file: %s: %s\n", path,
+            strerror(errno));
+    exit(1);
+  }
+  *size = len;
+  return buffer;
+}
+
+// read-only mapping of a whole file, for inputs only partly consumed
+static const u8 *map_file(const char *path, u64 *size) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to open input file: %s\n", path);
+    exit(1);
+  }
+  *size = st.st_size;
+  void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map input file: %s\n", path);
+    exit(1);
+  }
+  madvise(map, *size, MADV_SEQUENTIAL);
+  return map;
+}
+
+static void write_file(const char *path, const u8 *data, long size) {
+  FILE *out = fopen(path, "wb");
+  if (!out) {
+    fprintf(stderr, "Failed to open output file: %s\n", path);
+    exit(1);
+  }
+  fwrite(data, 1, size, out);
+  fclose(out);
+}
+
+/* Packs every input as a QOI stream named after its basename, P6 inputs are
+ * encoded on the way in and renamed to .qoi */
+static void pack_files(char **paths, u32 count, FILE *out) {
+  struct pack_input *inputs = calloc(count, sizeof(struct pack_input));
+  for (u32 k = 0; k < count; k++) {
+    const char *base = strrchr(paths[k], '/');
+    base = base ? base + 1 : paths[k];
+    long size;
+    u8 *data = read_input(paths[k], &size);
+    char *name = strdup(base);
+    if (size >= 3 && data[0] == 'P' && data[1] == '6' && data[2] == '\n') {
+      u8 *encoded = NULL;
+      size = encode(data, size, &encoded);
+      if (size < 0)
+        exit(1);
+      big_free(data);
+      data = encoded;
+      char *ext = strrchr(name, '.');
+      if (ext)
+        *ext = 0;
+      name = realloc(name, strlen(name) + 5);
+      strcat(name, ".qoi");
+    } else if (size < 4 || data[0] != 'q' || data[1] != 'o' ||
+               data[2] != 'i' || data[3] != 'f') {
+      fprintf(stderr, "Not a QOI or P6 image: %s\n", paths[k]);
+      exit(1);
+    }
+    inputs[k] = (struct pack_input){name, data, size};
+  }
+
+  u8 *packed = NULL;
+  long out_len = pack_build(inputs, count, &packed);
+  if (out_len < 0)
+    exit(1);
+  fwrite(packed, 1, out_len, out);
+
+  free(packed);
+  for (u32 k = 0; k < count; k++) {
+    free((char *)inputs[k].name);
+    big_free((u8 *)inputs[k].data);
+  }
+  free(inputs);
+}
+
+static void unpack_files(const char *pack_path, const char *dir) {
+  struct qoi_pack pack;
+  if (!pack_open(pack_path, &pack)) {
+    fprintf(stderr, "Failed to open pack file: %s\n", pack_path);
+    exit(1);
+  }
+  if (mkdir(dir, 0755) != 0 && !is_directory(dir)) {
+    fprintf(stderr, "Failed to create output directory: %s\n", dir);
+    exit(1);
+  }
+  bool failed = false;
+  for (u64 k = 0; k < pack.count; k++) {
+    const char *name = pack_entry_name(&pack, k);
+    // names come from the file, never let one escape the output directory
+    char path[PATH_MAX];
+    if (strchr(name, '/') || strstr(name, "..") ||
+        snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+      error("Refusing to unpack entry with unsafe name: %s", name);
+      failed = true;
+      continue;
+    }
+    write_file(path, pack.base + pack.entries[k].offset, pack.entries[k].size);
+  }
+  pack_close(&pack);
+  if (failed)
+    exit(1);
+}
+
+// "INPUT OUTPUT" per line, blank lines and lines starting with # are skipped
+static struct batch_job *read_manifest(const char *path, char **text,
+                                       u32 *count) {
+  long size;
+  u8 *data = read_input(path, &size);
+  // one spare byte so the last line can end without a newline
+  *text = malloc(size + 1);
+  memcpy(*text, data, size);
+  (*text)[size] = '\n';
+  big_free(data);
+  struct batch_job *jobs = NULL;
+  u32 cap = 0;
+  *count = 0;
+  char *line = *text;
+  char *end = line + size;
+  for (u32 lineno = 1; line < end; lineno++) {
+    char *eol = memchr(line, '\n', end + 1 - line);
+    *eol = '\0';
+    char *input = line + strspn(line, " \t\r");
+    line = eol + 1;
+    if (*input == '\0' || *input == '#')
+      continue;
+    char *sep = input + strcspn(input, " \t");
+    char *output = sep + strspn(sep, " \t");
+    output[strcspn(output, " \t\r")] = '\0';
+    *sep = '\0';
+    if (*output == '\0') {
+      error("%s:%u: expected INPUT OUTPUT", path, lineno);
+      exit(1);
+    }
+    if (*count == cap) {
+      cap = cap ? cap * 2 : 64;
+      jobs = realloc(jobs, cap * sizeof(struct batch_job));
+    }
+    jobs[(*count)++] = (struct batch_job){input, output};
+  }
+  return jobs;
+}
+
+static void run_batch(struct arguments *args) {
+  struct batch_job *jobs;
+  u32 count;
+  char *text = NULL;
+  if (args->manifest) {
+    jobs = read_manifest(args->manifest, &text, &count);
+  } else {
+    count = args->n_inputs;
+    jobs = calloc(count, sizeof(struct batch_job));
+    for (u32 k = 0; k < count; k++)
+      jobs[k] = (struct batch_job){args->inputs[k], args->outputs[k]};
+  }
+
+  struct batch_opts opts = {.mode = args->cmd == CMD_ENCODE ? BATCH_ENCODE
+                                                            : BATCH_DECODE,
+                            .threads = args->threads,
+                            .io_depth = args->io_depth,
+                            .io_uring = args->io_uring};
+  u32 failed = batch_run(jobs, count, &opts);
+  info("%u of %u files converted", count - failed, count);
+
+  free(jobs);
+  free(text);
+  if (failed)
+    exit(1);
+}
+
 void cli(int argc, char **argv) {
   struct arguments args;
   args.cmd = CMD_NONE;
   args.input = NULL;
   args.output = NULL;
+  args.name = NULL;
+  args.display_fmt = DISPLAY_AUTO;
+  args.files = calloc(argc, sizeof(char *));
+  args.inputs = calloc(argc, sizeof(char *));
+  args.outputs = calloc(argc, sizeof(char *));
+  args.n_inputs = 0;
+  args.n_outputs = 0;
+  args.manifest = NULL;
+  args.io_depth = 32;
+  args.io_uring = true;
+  args.n_files = 0;
+  args.prefetch = 2;
+  args.cache_mib = 512;
+  args.near_lossless = -1;
+  args.threads = 1;
+  args.tensor = false;
+  args.tensor_opts = TENSOR_OPTS_DEFAULT;
+  args.debounce_ms = 50;
+  args.stats_s = 10;
+  args.raw = false;
+  args.crop = false;
 
   argp_parse(&argp, argc, argv, 0, 0, &args);
 
-  /* READ INPUT FILE */
-  FILE *in = fopen(args.input, "rb");
-  if (!in) {
-    fprintf(stderr, "Failed to open input file: %s\n", args.input);
-    exit(1);
+  /* BATCH: many files through the io_uring engine */
+  if (args.n_inputs > 1 || args.manifest) {
+    run_batch(&args);
+    free(args.inputs);
+    free(args.outputs);
+    free(args.files);
+    return;
+  }
+  // only batch conversions use the -i/-o lists
+  free(args.inputs);
+  free(args.outputs);
+
+  /* DISPLAY several files or a directory as a slideshow */
+  if (args.cmd == CMD_DISPLAY &&
+      (args.n_files > 0 || is_directory(args.input))) {
+    char **paths = NULL;
+    u32 count = 0, cap = 0;
+    if (args.input)
+      collect_images(args.input, &paths, &count, &cap);
+    for (int k = 0; k < args.n_files; k++)
+      collect_images(args.files[k], &paths, &count, &cap);
+
+    display_files(paths, count, args.prefetch, (u64)args.cache_mib << 20);
+
+    for (u32 k = 0; k < count; k++)
+      free(paths[k]);
+    free(paths);
+    free(args.files);
+    return;
   }
-  fseek(in, 0, SEEK_END);
-  long size = ftell(in);
-  fseek(in, 0, SEEK_SET);
 
-  unsigned char *buffer = malloc(size);
-  fread(buffer, 1, size, in);
-  fclose(in);
+  if (args.cmd == CMD_WATCH) {
+    struct watch_opts opts = {.output_dir = args.output,
+                              .threads = args.threads,
+                              .debounce_ms = args.debounce_ms,
+                              .stats_interval_s = args.stats_s};
+    watch(args.input ? args.input : args.files[0], &opts);
+    free(args.files);
+    return;
+  }
+
+  if (args.cmd == CMD_UNPACK) {
+    unpack_files(args.input, args.output ? args.output : ".");
+    free(args.files);
+    return;
+  }
 
   /* Decide OUTPUT target */
   FILE *out = stdout;
@@ -135,32 +677,152 @@ void cli(int argc, char **argv) {
     }
   }
 
+  if (args.cmd == CMD_PACK) {
+    char **paths = NULL;
+    u32 count = 0, cap = 0;
+    if (args.input)
+      collect_images(args.input, &paths, &count, &cap);
+    for (int k = 0; k < args.n_files; k++)
+      collect_images(args.files[k], &paths, &count, &cap);
+
+    pack_files(paths, count, out);
+
+    for (u32 k = 0; k < count; k++)
+      free(paths[k]);
+    free(paths);
+    if (args.output)
+      fclose(out);
+    free(args.files);
+    return;
+  }
+
+  /* DECODE one image out of a pack: a single mmap, no copy of the stream */
+  if (args.cmd == CMD_DECODE && args.name) {
+    struct qoi_pack pack;
+    if (!pack_open(args.input, &pack)) {
+      fprintf(stderr, "Failed to open pack file: %s\n", args.input);
+      exit(1);
+    }
+    u8 *decoded = NULL;
+    long out_len;
+    if (args.crop) {
+      u64 qoi_size;
+      const u8 *qoi = pack_find(&pack, args.name, &qoi_size);
+      if (qoi == NULL) {
+        error("There is no image named %s in this pack", args.name);
+        exit(1);
+      }
+      out_len = decode_crop(qoi, qoi_size, args.crop_rect[0],
+                            args.crop_rect[1], args.crop_rect[2],
+                            args.crop_rect[3], &decoded);
+    } else {
+      out_len = decode_packed(&pack, args.name, &decoded);
+    }
+    if (out_len < 0)
+      exit(1);
+    fwrite(decoded, 1, out_len, out);
+
+    big_free(decoded);
+    pack_close(&pack);
+    if (args.output)
+      fclose(out);
+    free(args.files);
+    return;
+  }
+
+  /* DECODE a region: the input is mapped, pages past the crop are never read */
+  if (args.cmd == CMD_DECODE && args.crop) {
+    u64 qoi_size;
+    const u8 *qoi = map_file(args.input, &qoi_size);
+    u8 *decoded = NULL;
+    long out_len = decode_crop(qoi, qoi_size, args.crop_rect[0],
+                               args.crop_rect[1], args.crop_rect[2],
+                               args.crop_rect[3], &decoded);
+    if (out_len < 0)
+      exit(1);
+    fwrite(decoded, 1, out_len, out);
+
+    big_free(decoded);
+    munmap((void *)qoi, qoi_size);
+    if (args.output)
+      fclose(out);
+    free(args.files);
+    return;
+  }
+
+  /* READ INPUT FILE */
+  long size;
+  unsigned char *buffer = read_input(args.input, &size);
+
   if (args.cmd == CMD_ENCODE) {
 
     u8 *encoded = NULL;
-    int out_len;
-    out_len = encode(buffer, size, &encoded);
+    long out_len;
+    if (args.raw) {
+      // rows may be padded, the stride is whatever the height divides into
+      u64 bpp = args.raw_format == RAW_RGB ? 3 : 4;
+      u64 stride = args.raw_height ? (u64)size / args.raw_height : 0;
+      if (args.raw_height == 0 || (u64)size % args.raw_height != 0 ||
+          stride < bpp * args.raw_width) {
+        error("%s holds %ld bytes, not %u rows of %u pixels", args.input,
+              size, args.raw_height, args.raw_width);
+        exit(1);
+      }
+      out_len = encode_raw(buffer, args.raw_width, args.raw_height, stride,
+                           args.raw_format, &encoded, args.threads);
+    } else if (args.near_lossless >= 0) {
+      struct near_lossless_stats stats;
+      out_len = encode_near_lossless(buffer, size, &encoded,
+                                     args.near_lossless, &stats, args.threads);
+      if (out_len >= 0)
+        info("near-lossless N=%d: max error %u, PSNR %.2f dB",
+             args.near_lossless, stats.max_error, stats.psnr);
+    } else {
+      out_len = encode_parallel(buffer, size, &encoded, args.threads);
+    }
+    if (out_len < 0)
+      exit(1);
 
     fwrite(encoded, 1, out_len, out);
 
-    free(encoded);
+    big_free(encoded);
+
+  } else if (args.cmd == CMD_DECODE && args.tensor) {
+
+    void *tensor = NULL;
+    u32 width, height;
+    long out_len = decode_tensor(buffer, size, &args.tensor_opts, &tensor,
+                                 &width, &height);
+    if (out_len < 0)
+      exit(1);
+    if (args.tensor_opts.layout == TENSOR_CHW)
+      info("tensor: 3x%ux%u (CHW) %s", height, width,
+           args.tensor_opts.dtype == TENSOR_F32 ? "float32" : "float16");
+    else
+      info("tensor: %ux%ux3 (HWC) %s", height, width,
+           args.tensor_opts.dtype == TENSOR_F32 ? "float32" : "float16");
 
+    fwrite(tensor, 1, out_len, out);
+
+    big_free(tensor);
   } else if (args.cmd == CMD_DECODE) {
 
     u8 *decoded = NULL;
-    int out_len;
-    out_len = decode(buffer, &decoded);
+    long out_len;
+    out_len = decode(buffer, size, &decoded);
+    if (out_len < 0)
+      exit(1);
 
     fwrite(decoded, 1, out_len, out);
 
-    free(decoded);
+    big_free(decoded);
   } else if (args.cmd == CMD_DISPLAY) {
     switch(args.display_fmt){
       case DISPLAY_PPM_P6:
-        display_ppm_p6(buffer);
+        display_ppm_p6(buffer, size);
         break;
       case DISPLAY_QOI:
-        display_qoi(buffer);
+        display_qoi(buffer, size);
         break;
     }
   }
@@ -168,5 +830,6 @@ void cli(int argc, char **argv) {
   if (args.output)
     fclose(out);
 
-  free(buffer);
+  big_free(buffer);
+  free(args.files);
 }
@@ -1,12 +1,17 @@
 #include "decode.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include <pretty.h>
 
+#include "alloc.h"
 
-#define hash(p) ( (p.r * 3 + p.g * 5 + p.b * 7 + 255 * 11) & 63 )
+
+// alpha is tracked so RGBA streams index the same slots the encoder did, it
+// is only dropped on output
+#define hash(p) ( (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) & 63 )
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #define likely(x)   __builtin_expect(!!(x), 1)
@@ -22,9 +27,9 @@
 #endif
 
 #if IS_LITTLE_ENDIAN == 1 
-  #define bytes_to_u32(buffer) (*(buffer) | *(buffer + 1) << 8 | *(buffer + 2) << 16 | *(buffer + 3) << 24)
+  #define bytes_to_u32(buffer) (*(buffer) | *(buffer + 1) << 8 | *(buffer + 2) << 16 | (u32)*(buffer + 3) << 24)
 #else 
-  #define bytes_to_u32(buffer) (*(buffer + 3) | *(buffer + 2) << 8 | *(buffer + 1) << 16 | *(buffer) << 24)
+  #define bytes_to_u32(buffer) (*(buffer + 3) | *(buffer + 2) << 8 | *(buffer + 1) << 16 | (u32)*(buffer) << 24)
 #endif
 
 static inline u8 u32_to_str(u32 x, u8 bytes[10])
@@ -39,19 +44,173 @@ static inline u8 u32_to_str(u32 x, u8 bytes[10])
 
 }
 
-long decode(u8* qoi_buffer, u8** p6_buffer ){
+void qoi_decoder_init(struct qoi_decoder* decoder, const u8* qoi_buffer, u64 size){
+  decoder->qoi = qoi_buffer;
+  decoder->size = size;
+  decoder->cursor = 14;
+  decoder->prev = (struct qoi_pixel){0, 0, 0, 255};
+  memset(decoder->array, 0, sizeof(decoder->array));
+  decoder->run = 0;
+  decoder->truncated = false;
+}
+
+// slow path of decode_op near the end of the stream
+static bool op_fits(const u8* qoi_buffer, u64 cursor, u64 size){
+  if ( cursor >= size ) return false;
+  u8 tag = qoi_buffer[cursor];
+  u64 len = tag == 0xFF ? 5 : tag == 0xFE ? 4 : (tag & 0xC0) == 0x80 ? 2 : 1;
+  return cursor + len <= size;
+}
+
+// decodes the op at `*cursor` into `*curr`, returns how many pixels it covers
+// or 0 when the op does not fit in the `size` bytes of the stream
+static inline __attribute__((always_inline)) u32 decode_op(const u8* qoi_buffer, u64 size, u64* cursor, struct qoi_pixel* curr, struct qoi_pixel array[64]){
+  u64 qoi_cursor = *cursor;
+  u32 count = 1;
+  i8 vardr, vardb, vardg, dr_dg, db_dg;
+
+  // no op is longer than 5 bytes
+  if ( unlikely(qoi_cursor + 5 > size) && !op_fits(qoi_buffer, qoi_cursor, size) )
+    return 0;
+
+  // QOI_OP_INDEX
+  if ( (qoi_buffer[qoi_cursor] & 0xC0) == 0 )  {
+    *curr = array[qoi_buffer[qoi_cursor]];
+    qoi_cursor ++;
+  }
+  // QOI_OP_DIFF
+  // cur - prev = var -> curr = var + prev
+  else if ( (qoi_buffer[qoi_cursor] & 0xC0 ) == 0x40){
+    vardr = ((qoi_buffer[qoi_cursor] >> 4) & 0x03 ) - 2; 
+    vardg = ((qoi_buffer[qoi_cursor] >> 2) & 0x03 )- 2; 
+    vardb = (qoi_buffer[qoi_cursor] & 0x03 ) - 2; 
+    *curr = (struct qoi_pixel){curr->r + vardr, curr->g + vardg, curr->b + vardb, curr->a};
+    array[hash((*curr))] = *curr;
+    qoi_cursor ++;
+  }
+  // QOI_OP_LUMA
+  // dg = curr.g  - prev.g      => curr.g = dg + prev.g
+  // dr_dg = curr.r - prev.r - curr.g + prev.g
+  //       = curr.r - prev.r - dg - prev.g + prev.g
+  //       = curr.r - prev.r - dg 
+  // curr.r = dr_dg + prev.r + dg
+  else if ( (qoi_buffer[qoi_cursor] & 0xC0) == 0x80 ){
+    vardg = (qoi_buffer[qoi_cursor] & 0x3F) - 32;
+    dr_dg = (qoi_buffer[qoi_cursor + 1] >> 4) - 8;
+    db_dg = (qoi_buffer[qoi_cursor + 1] & 0x0F) - 8;
+    *curr = (struct qoi_pixel){dr_dg + curr->r + vardg, vardg + curr->g, db_dg + curr->b + vardg, curr->a};
+    array[hash((*curr))] = *curr;
+    qoi_cursor += 2;
+  }
+  // QOI_OP_RGB
+  else if  (qoi_buffer[qoi_cursor] == 0xFE ){
+    *curr = (struct qoi_pixel){qoi_buffer[qoi_cursor + 1], qoi_buffer[qoi_cursor + 2], qoi_buffer[qoi_cursor + 3], curr->a};
+    array[hash((*curr))] = *curr;
+    qoi_cursor += 4;
+  }
+  // QOI_OP_RGBA, never emitted for P6 input but valid in 4 channel streams
+  else if  (unlikely(qoi_buffer[qoi_cursor] == 0xFF )){
+    *curr = (struct qoi_pixel){qoi_buffer[qoi_cursor + 1], qoi_buffer[qoi_cursor + 2], qoi_buffer[qoi_cursor + 3], qoi_buffer[qoi_cursor + 4]};
+    array[hash((*curr))] = *curr;
+    qoi_cursor += 5;
+  }
+  // QOI_OP_RUN, `curr` repeated
+  else {
+    count = (qoi_buffer[qoi_cursor] & 0x3F) + 1;
+    qoi_cursor ++;
+  }
+
+  *cursor = qoi_cursor;
+  return count;
+}
+
+bool qoi_decode_rgb(struct qoi_decoder* decoder, u8* rgb, u64 count){
+  u64 qoi_cursor = decoder->cursor;
+  struct qoi_pixel curr = decoder->prev;
+  u32 run = decoder->run;
+
+  for(u64 i = 0; i < count; i++, rgb += 3){
+    if ( run > 0 ){
+      run--;
+    }
+    else {
+      u32 n = decode_op(decoder->qoi, decoder->size, &qoi_cursor, &curr, decoder->array);
+      if ( unlikely(n == 0) ){
+        decoder->truncated = true;
+        break;
+      }
+      // the first pixel of a run is this one, the rest are owed
+      run = n - 1;
+    }
+    rgb[0] = curr.r;
+    rgb[1] = curr.g;
+    rgb[2] = curr.b;
+  }
+
+  decoder->cursor = qoi_cursor;
+  decoder->prev = curr;
+  decoder->run = run;
+  return !decoder->truncated;
+}
+
+bool qoi_skip(struct qoi_decoder* decoder, u64 count){
+  u64 qoi_cursor = decoder->cursor;
+  struct qoi_pixel curr = decoder->prev;
+  u64 run = decoder->run;
+
+  // runs are consumed whole, only ops that change the state are looked at
+  while ( count > 0 ){
+    if ( run == 0 ){
+      run = decode_op(decoder->qoi, decoder->size, &qoi_cursor, &curr, decoder->array);
+      if ( unlikely(run == 0) ){
+        decoder->truncated = true;
+        break;
+      }
+    }
+    u64 take = run < count ? run : count;
+    run -= take;
+    count -= take;
+  }
+
+  decoder->cursor = qoi_cursor;
+  decoder->prev = curr;
+  decoder->run = run;
+  return !decoder->truncated;
+}
+
+bool qoi_read_header(const u8* qoi_buffer, u64 size, u32* width, u32* height){
+  if ( size < QOI_MIN_SIZE ){
+    error("Input is %lu bytes, too short to hold a QOI header and end marker", size);
+    return false;
+  }
   if (!
     (qoi_buffer[0] == 'q' && qoi_buffer[1] == 'o'
     && qoi_buffer[2] == 'i' && qoi_buffer[3] == 'f')
   ){
     error("Input file format does not cotain the QOI file format header according to the spec and thus might either be corrupted or follow another format");
+    return false;
   }
-  u32 width = bytes_to_u32(qoi_buffer+4);
-  u32 height = bytes_to_u32(qoi_buffer+8);
+  *width = bytes_to_u32(qoi_buffer+4);
+  *height = bytes_to_u32(qoi_buffer+8);
+  return true;
+}
+
+// allocates (unless the caller passed a buffer) and writes the P6 header,
+// returns the offset of the first pixel or 0 when the image is too large
+static u64 p6_start(u32 width, u32 height, u8** p6_buffer, u64* p6_size){
   u8 widths[10] = {0}, heights[10] = {0};
   u8 len_widths = u32_to_str(width, widths);
   u8 len_heights = u32_to_str(height, heights);
-  *p6_buffer = *p6_buffer == NULL ? malloc(9 + len_heights + len_widths + 3 * width * height) : *p6_buffer;
+  if ( __builtin_mul_overflow((u64)width * height, 3, p6_size)
+       || __builtin_add_overflow(*p6_size, 9 + len_heights + len_widths, p6_size) ){
+    error("Image too large to decode: %ux%u", width, height);
+    return 0;
+  }
+  *p6_buffer = *p6_buffer == NULL ? big_alloc(*p6_size) : *p6_buffer;
+  if ( *p6_buffer == NULL ){
+    error("Failed to allocate %lu bytes for the P6 output", *p6_size);
+    return 0;
+  }
 
   (*p6_buffer)[0] = 'P';
   (*p6_buffer)[1] = '6';
@@ -70,94 +229,39 @@ long decode(u8* qoi_buffer, u8** p6_buffer ){
   (*p6_buffer)[7 + len_widths + len_heights] = '5';
   (*p6_buffer)[8 + len_widths + len_heights] = '\n';
 
-  u64 p6_cursor = 9 + len_heights + len_widths;
-  u64 qoi_cursor = 14;
-  
-  struct qoi_pixel array[64] = {0};
-  struct qoi_pixel qoi_pix = {0};
-  struct p6_pixel prev = {0};
-  struct p6_pixel curr = {0};
-  i8 vardr, vardb, vardg, dr_dg, db_dg;
-  for(u64 i = 0; i < width * height; i++){
-    // QOI_OP_INDEX
-    if ( (qoi_buffer[qoi_cursor] & 0xC0) == 0 )  {
-      qoi_pix = array[qoi_buffer[qoi_cursor]];
-      (*p6_buffer)[p6_cursor] = qoi_pix.r;
-      (*p6_buffer)[p6_cursor + 1] = qoi_pix.g;
-      (*p6_buffer)[p6_cursor + 2] = qoi_pix.b;
-      p6_cursor += 3;
-      qoi_cursor ++;
-      prev = (struct p6_pixel){qoi_pix.r, qoi_pix.g, qoi_pix.b};
-      continue;
-    }
-    // QOI_OP_DIFF
-    // cur - prev = var -> curr = var + prev
-    if ( (qoi_buffer[qoi_cursor] & 0xC0 ) == 0x40){
-      vardr = ((qoi_buffer[qoi_cursor] >> 4) & 0x03 ) - 2; 
-      vardg = ((qoi_buffer[qoi_cursor] >> 2) & 0x03 )- 2; 
-      vardb = (qoi_buffer[qoi_cursor] & 0x03 ) - 2; 
-      curr = (struct p6_pixel){prev.r + vardr, prev.g + vardg, prev.b + vardb};
-      (*p6_buffer)[p6_cursor] = curr.r;
-      (*p6_buffer)[p6_cursor + 1] = curr.g;
-      (*p6_buffer)[p6_cursor + 2] = curr.b;
-      array[hash(curr)] = (struct qoi_pixel){curr.r, curr.g, curr.b, 255};
-      prev = curr;
-      p6_cursor += 3;
-      qoi_cursor ++;
-      continue;
-    }
-    // QOI_OP_LUMA
-    // dg = curr.g  - prev.g      => curr.g = dg + prev.g
-    // dr_dg = curr.r - prev.r - curr.g + prev.g
-    //       = curr.r - prev.r - dg - prev.g + prev.g
-    //       = curr.r - prev.r - dg 
-    // curr.r = dr_dg + prev.r + dg
-    if ( (qoi_buffer[qoi_cursor] & 0xC0) == 0x80 ){
-      vardg = (qoi_buffer[qoi_cursor] & 0x3F) - 32;
-      dr_dg = (qoi_buffer[qoi_cursor + 1] >> 4) - 8;
-      db_dg = (qoi_buffer[qoi_cursor + 1] & 0x0F) - 8;
-      curr = (struct p6_pixel){dr_dg + prev.r + vardg, vardg + prev.g, db_dg + prev.b + vardg};
-      (*p6_buffer)[p6_cursor] = curr.r;
-      (*p6_buffer)[p6_cursor + 1] = curr.g;
-      (*p6_buffer)[p6_cursor + 2] = curr.b;
-      array[hash(curr)] = (struct qoi_pixel){curr.r, curr.g, curr.b, 255};
-      prev = curr;
-      p6_cursor += 3;
-      qoi_cursor += 2;
-      continue;
-    }
-    // QOI_OP_RGB
-    if  (qoi_buffer[qoi_cursor] == 0xFE ){
-      curr = (struct p6_pixel){qoi_buffer[qoi_cursor + 1], qoi_buffer[qoi_cursor + 2], qoi_buffer[qoi_cursor + 3]};
-      (*p6_buffer)[p6_cursor] = curr.r;
-      (*p6_buffer)[p6_cursor + 1] = curr.g;
-      (*p6_buffer)[p6_cursor + 2] = curr.b; 
-      array[hash(curr)] = (struct qoi_pixel){curr.r, curr.g, curr.b, 255};
-      prev = curr;
-      p6_cursor += 3;
-      qoi_cursor += 4;
-      continue;
-    }
-    // QOI_OP_RGBA (impossible in the case of P6)
-    if  (unlikely(qoi_buffer[qoi_cursor] == 0xFF )){
-      error("an encoding of P6 format in QOI format is not supposed to encode QOI_OP_RGBA chunks!");
-      continue;
-    }
-    // QOI_OP_RUN
-    u8 run = (qoi_buffer[qoi_cursor] & 0x3F) + 1;
-    unsigned j = 0;
-    for(; j < run * 3; j+=3){
-      (*p6_buffer)[p6_cursor+j] = curr.r;
-      (*p6_buffer)[p6_cursor+j+1] = curr.g;
-      (*p6_buffer)[p6_cursor+j+2] = curr.b;
-    }
-    p6_cursor += j;
-    qoi_cursor ++;
-    i += run - 1;
+  return 9 + len_heights + len_widths;
+}
 
+// frees the output on failure when the decoder allocated it
+static long decode_failed(u8** p6_buffer, bool owned){
+  if ( owned ){
+    big_free(*p6_buffer);
+    *p6_buffer = NULL;
   }
+  return -1;
+}
+
+long decode(u8* qoi_buffer, u64 size, u8** p6_buffer ){
+  u32 width, height;
+  if ( !qoi_read_header(qoi_buffer, size, &width, &height) )
+    return -1;
+  bool owned = *p6_buffer == NULL;
+  u64 p6_size;
+  u64 p6_cursor = p6_start(width, height, p6_buffer, &p6_size);
+  if ( p6_cursor == 0 )
+    return -1;
+
+  struct qoi_decoder decoder;
+  qoi_decoder_init(&decoder, qoi_buffer, size);
+  if ( !qoi_decode_rgb(&decoder, *p6_buffer + p6_cursor, (u64)width * height) ){
+    error("QOI stream ends before its last pixel");
+    return decode_failed(p6_buffer, owned);
+  }
+  u64 qoi_cursor = decoder.cursor;
+
   if (!
-    (qoi_buffer[qoi_cursor] == 0 &&
+    (qoi_cursor + 8 <= size &&
+    qoi_buffer[qoi_cursor] == 0 &&
     qoi_buffer[qoi_cursor+1] == 0 && 
     qoi_buffer[qoi_cursor+2] == 0 && 
     qoi_buffer[qoi_cursor+3] == 0 && 
@@ -170,5 +274,47 @@ long decode(u8* qoi_buffer, u8** p6_buffer ){
   }
 
 
-  return 9 + len_heights + len_widths + 3 * width * height;
+  return p6_size;
+}
+
+long decode_crop(const u8* qoi_buffer, u64 size, u32 x, u32 y, u32 w, u32 h, u8** p6_buffer){
+  u32 width, height;
+  if ( !qoi_read_header(qoi_buffer, size, &width, &height) )
+    return -1;
+  if ( w == 0 || h == 0 || x >= width || y >= height || w > width - x || h > height - y ){
+    error("Crop %ux%u+%u+%u is not inside the %ux%u image", w, h, x, y, width, height);
+    return -1;
+  }
+  bool owned = *p6_buffer == NULL;
+  u64 p6_size;
+  u64 p6_cursor = p6_start(w, h, p6_buffer, &p6_size);
+  if ( p6_cursor == 0 )
+    return -1;
+
+  // rows above and the pixels around the region only advance the state, the
+  // stream after the last cropped pixel is never touched
+  struct qoi_decoder decoder;
+  qoi_decoder_init(&decoder, qoi_buffer, size);
+  bool ok = qoi_skip(&decoder, (u64)y * width + x);
+  for ( u32 row = 0; ok && row < h; row++ ){
+    if ( row > 0 )
+      ok = qoi_skip(&decoder, width - w);
+    ok = ok && qoi_decode_rgb(&decoder, *p6_buffer + p6_cursor + (u64)row * w * 3, w);
+  }
+  if ( !ok ){
+    error("QOI stream ends before the last pixel of the crop");
+    return decode_failed(p6_buffer, owned);
+  }
+
+  return p6_size;
+}
+
+long decode_packed(const struct qoi_pack* pack, const char* name, u8** p6_buffer){
+  u64 size;
+  const u8* qoi_buffer = pack_find(pack, name, &size);
+  if ( qoi_buffer == NULL ){
+    error("There is no image named %s in this pack", name);
+    return -1;
+  }
+  return decode((u8*)qoi_buffer, size, p6_buffer);
 }
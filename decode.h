@@ -3,9 +3,33 @@
 
 
 
-#include "types.h"
+#include <stdbool.h>
 
-long decode(u8* qoi_buffer, u8** p6_buffer); 
+#include "types.h"
+#include "pack.h"
+
+// streaming decoder state, lets callers pull pixels a few rows at a time
+struct qoi_decoder {
+  const u8* qoi;
+  u64 cursor;
+  struct qoi_pixel prev;
+  struct qoi_pixel array[64];
+  u32 run; // pixels of prev still owed by the current QOI_OP_RUN
+  u64 size; // bytes of the stream, no op past it is read
+  bool truncated;
+};
+
+// header plus end marker, nothing shorter is a QOI stream
+#define QOI_MIN_SIZE 22
+
+bool qoi_read_header(const u8* qoi_buffer, u64 size, u32* width, u32* height); // checks the size and magic, reports the dimensions
+void qoi_decoder_init(struct qoi_decoder* decoder, const u8* qoi_buffer, u64 size);
+bool qoi_decode_rgb(struct qoi_decoder* decoder, u8* rgb, u64 count); // next `count` pixels as packed RGB, false when the stream ends first
+bool qoi_skip(struct qoi_decoder* decoder, u64 count); // advances past `count` pixels without writing them, false when the stream ends first
+
+long decode(u8* qoi_buffer, u64 size, u8** p6_buffer); // NOTE: you must big_free() the output of decode, -1 on a malformed or truncated stream or when the image is too large
+long decode_crop(const u8* qoi_buffer, u64 size, u32 x, u32 y, u32 w, u32 h, u8** p6_buffer); // only the w x h region at (x, y), output sized to the crop
+long decode_packed(const struct qoi_pack* pack, const char* name, u8** p6_buffer); // decodes straight out of the pack mapping
 
 
 
@@ -1,11 +1,14 @@
 #include "encode.h"
 
 #include <assert.h>
+#include <math.h>
 #include <pretty.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc.h"
 #include "types.h"
 
 #define between(value, a, b) ((i64)a <= (i64)value && (i64)value <= (i64)b)
@@ -16,126 +19,365 @@
 #define db(p1, p2) ((i16)p1.b - (i16)p2.b)
 #define hash(p)                                                                \
   (((u32)p.r * 3 + (u32)p.g * 5 + (u32)p.b * 7 + (u32)p.a * 11) & 63)
-#define eq_p6(p1, p2) (p1.r == p2.r && p1.g == p2.g && p1.b == p2.b)
 #define eq_qoi(p1, p2)                                                         \
   (p1.r == p2.r && p1.g == p2.g && p1.b == p2.b && p1.a == p2.a)
-#define from_p6_pixel(p) ((struct qoi_pixel){p.r, p.g, p.b, 255})
 #define flush fflust(stdout)
 
+// below this many pixels per thread the split is not worth the threads
+#define ENCODE_MIN_SEGMENT 65536
+
 struct p6_pixel from_qoi_pixel(struct qoi_pixel pixel) {
   return (struct p6_pixel){pixel.r, pixel.g, pixel.b};
 }
 
-long encode(u8 *p6_buffer, u32 p6_size, u8 **qoi_buffer) {
+// parses the P6 header, returns the offset of the first pixel or 0 when the
+// header is malformed or runs past the buffer
+static u64 parse_p6_header(u8 *p6_buffer, u64 p6_size, u32 *width,
+                           u32 *height) {
   assert(p6_buffer[0] == 'P' && p6_buffer[1] == '6' && p6_buffer[2] == '\n');
-  info("p6_buffer size: %u", p6_size);
   u64 i = 3;
-  u32 width = 0, height = 0, max_col_val = 0;
-  while (p6_buffer[i] != ' ') {
-    width = width * 10 + p6_buffer[i] - '0';
+  u64 w = 0, h = 0;
+  while (i < p6_size && p6_buffer[i] != ' ' && w <= UINT32_MAX) {
+    w = w * 10 + p6_buffer[i] - '0';
     i++;
   }
   i++;
-  while (p6_buffer[i] != '\n') {
-    height = height * 10 + p6_buffer[i] - '0';
+  while (i < p6_size && p6_buffer[i] != '\n' && h <= UINT32_MAX) {
+    h = h * 10 + p6_buffer[i] - '0';
     i++;
   }
   i++;
-  while (p6_buffer[i] != '\n') {
-    max_col_val = max_col_val * 10 + p6_buffer[i] - '0';
+  while (i < p6_size && p6_buffer[i] != '\n')
     i++;
-  }
   i++;
-  struct p6_pixel p6_pixel_vec[width * height];
-
-  u32 total_pixels = width * height;
-  u64 byte_offset;
-  for (u32 pixel_idx = 0; pixel_idx < total_pixels; pixel_idx++) {
-    byte_offset = i + pixel_idx * 3;
-    p6_pixel_vec[pixel_idx] =
-        (struct p6_pixel){.r = p6_buffer[byte_offset],
-                          .g = p6_buffer[byte_offset + 1],
-                          .b = p6_buffer[byte_offset + 2]};
+  if (i > p6_size || w > UINT32_MAX || h > UINT32_MAX)
+    return 0;
+  *width = w;
+  *height = h;
+  return i;
+}
+
+// the P6 pixel data is used in place, struct p6_pixel has the same layout
+_Static_assert(sizeof(struct p6_pixel) == 3, "p6_pixel must be packed RGB");
+
+static struct p6_pixel *p6_pixels(u8 *p6_buffer, u64 p6_size, u32 *width,
+                                  u32 *height) {
+  u64 i = parse_p6_header(p6_buffer, p6_size, width, height);
+  u64 bytes;
+  if (i == 0 || __builtin_mul_overflow((u64)*width * *height, 3, &bytes) ||
+      bytes > p6_size - i) {
+    error("Malformed P6 header or truncated pixel data");
+    return NULL;
   }
-  *qoi_buffer = *qoi_buffer == NULL
-                    ? malloc(sizeof(struct qoi_header) + 5 * width * height + 11)
-                    : *qoi_buffer;
-  memcpy(*qoi_buffer,
-         &(struct qoi_header){.magic = {'q', 'o', 'i', 'f'},
-                              .width = width,
-                              .height = height,
-                              .channels = 3,
-                              .colorspace = 0},
-         sizeof(struct qoi_header));
-  struct qoi_pixel prev = (struct qoi_pixel){0, 0, 0, 255};
+  return (struct p6_pixel *)(p6_buffer + i);
+}
+
+/*
+ * Raw pixel layouts. Every layout is read through a `struct raw_image` (base,
+ * width and row stride in bytes) and gets its own copy of the encoder loop,
+ * instantiated from the template below with the bytes per pixel and channel
+ * offsets as constants, so the hot loop never looks at the format.
+ */
+struct raw_image {
+  const u8 *base;
+  u32 width;
+  u64 stride;
+};
+
+static inline __attribute__((always_inline)) struct qoi_pixel
+load_pixel(const u8 *p, const int r, const int g, const int b) {
+  return (struct qoi_pixel){p[r], p[g], p[b], 255};
+}
+
+/*
+ * Encodes pixels [begin, end) starting from the encoder state at `begin`:
+ * `prev` and `array` are updated in place, returns the number of bytes
+ * written to `out`.
+ */
+static inline __attribute__((always_inline)) u64
+encode_span_template(const struct raw_image *img, u64 begin, u64 end,
+                     struct qoi_pixel *prev_state, struct qoi_pixel array[64],
+                     u8 *out, const u32 bpp, const int ro, const int go,
+                     const int bo) {
+  if (begin >= end)
+    return 0;
+  struct qoi_pixel prev = *prev_state;
   struct qoi_pixel curr;
-  struct qoi_pixel array[64] = {0};
   u8 h;
   i16 vardr, vardg, vardb;
   i8 dr_dg, db_dg;
-  u64 j = 14, run = 0;
-  // asm volatile("int3");
-  for (i = 0; i < width * height; i++) {
-    curr = from_p6_pixel(p6_pixel_vec[i]);
-
-    // QOI_OP_RUN case
-    if (eq_qoi(curr, prev)) {
-      run = 1;
-      // Look ahead for consecutive same pixels
-      while (run < 62 && i + run < width * height &&
-             eq_qoi(curr, from_p6_pixel(p6_pixel_vec[i + run]))) {
+  u64 j = 0, run = 0;
+  u64 y = begin / img->width, x = begin % img->width;
+  // one row (or the part of it inside the span) per outer iteration
+  for (u64 i = begin; i < end; i += img->width - x, x = 0, y++) {
+    const u8 *p = img->base + y * img->stride + x * bpp;
+    const u8 *row_end =
+        p + (end - i < img->width - x ? end - i : img->width - x) * bpp;
+    for (; p < row_end; p += bpp) {
+      curr = load_pixel(p, ro, go, bo);
+
+      // QOI_OP_RUN case
+      if (eq_qoi(curr, prev)) {
         run++;
+        // Look ahead for consecutive same pixels in this row
+        while (run < 62 && p + bpp < row_end &&
+               eq_qoi(curr, load_pixel(p + bpp, ro, go, bo))) {
+          p += bpp;
+          run++;
+        }
+        if (run == 62) {
+          out[j++] = 0xC0 | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+      if (run > 0) {
+        out[j++] = 0xC0 | (run - 1);
+        run = 0;
       }
-      (*qoi_buffer)[j++] = 0xC0 | (run - 1);
-      i += (run - 1); // Skip the pixels we just encoded as run
-      continue;
-    }
 
-    h = hash(curr);
+      h = hash(curr);
+
+      // QOI_OP_INDEX case
+      if (eq_qoi(curr, array[h])) {
+        out[j++] = h; // Just the index (lower 6 bits)
+        prev = curr;
+        array[h] = curr;
+        continue;
+      }
 
-    // QOI_OP_INDEX case
-    if (eq_qoi(curr, array[h])) {
-      (*qoi_buffer)[j++] = h; // Just the index (lower 6 bits)
-      prev = curr;
       array[h] = curr;
-      continue;
-    }
 
-    array[h] = curr;
+      vardr = dr(curr, prev);
+      vardg = dg(curr, prev);
+      vardb = db(curr, prev);
 
-    vardr = dr(curr, prev);
-    vardg = dg(curr, prev);
-    vardb = db(curr, prev);
+      // QOI_OP_DIFF case
+      if (between(vardr, -2, 1) && between(vardg, -2, 1) &&
+          between(vardb, -2, 1)) {
+        out[j++] =
+            0x40 | ((vardr + 2) << 4) | ((vardg + 2) << 2) | (vardb + 2);
+        prev = curr;
+        continue;
+      }
+
+      dr_dg = diffr_g(curr, prev);
+      db_dg = diffb_g(curr, prev);
+
+      // QOI_OP_LUMA case
+      if (between(vardg, -32, 31) && between(dr_dg, -8, 7) &&
+          between(db_dg, -8, 7)) {
+        out[j++] = 0x80 | (vardg + 32);
+        out[j++] = ((dr_dg + 8) << 4) | (db_dg + 8);
+        prev = curr;
+        continue;
+      }
 
-    // QOI_OP_DIFF case
-    if (between(vardr, -2, 1) && between(vardg, -2, 1) &&
-        between(vardb, -2, 1)) {
-      (*qoi_buffer)[j++] =
-          0x40 | ((vardr + 2) << 4) | ((vardg + 2) << 2) | (vardb + 2);
+      // QOI_OP_RGB case
+      out[j++] = 0xFE;
+      out[j++] = curr.r;
+      out[j++] = curr.g;
+      out[j++] = curr.b;
       prev = curr;
-      continue;
     }
+  }
+  if (run > 0)
+    out[j++] = 0xC0 | (run - 1);
 
-    dr_dg = diffr_g(curr, prev);
-    db_dg = diffb_g(curr, prev);
+  *prev_state = prev;
+  return j;
+}
 
-    // QOI_OP_LUMA case
-    if (between(vardg, -32, 31) && between(dr_dg, -8, 7) &&
-        between(db_dg, -8, 7)) {
-      (*qoi_buffer)[j++] = 0x80 | (vardg + 32);
-      (*qoi_buffer)[j++] = ((dr_dg + 8) << 4) | (db_dg + 8);
-      prev = curr;
-      continue;
+struct raw_layout {
+  u32 bpp;
+  // single pixel fetch for segment boundaries, not for the hot loop
+  struct qoi_pixel (*pixel)(const struct raw_image *img, u64 i);
+  u64 (*encode_span)(const struct raw_image *img, u64 begin, u64 end,
+                     struct qoi_pixel *prev_state, struct qoi_pixel array[64],
+                     u8 *out);
+};
+
+#define RAW_LAYOUT(name, bpp, r, g, b)                                        \
+  static struct qoi_pixel pixel_##name(const struct raw_image *img, u64 i) {   \
+    return load_pixel(img->base + i / img->width * img->stride +              \
+                          i % img->width * (bpp),                             \
+                      r, g, b);                                               \
+  }                                                                            \
+  static u64 encode_span_##name(const struct raw_image *img, u64 begin,       \
+                                u64 end, struct qoi_pixel *prev_state,        \
+                                struct qoi_pixel array[64], u8 *out) {        \
+    return encode_span_template(img, begin, end, prev_state, array, out,      \
+                                bpp, r, g, b);                                \
+  }
+
+RAW_LAYOUT(rgb, 3, 0, 1, 2)
+RAW_LAYOUT(bgrx, 4, 2, 1, 0)
+
+// alpha is dropped, the QOI streams written here are always 3 channels
+static const struct raw_layout raw_layouts[] = {
+    [RAW_RGB] = {3, pixel_rgb, encode_span_rgb},
+    [RAW_BGRA] = {4, pixel_bgrx, encode_span_bgrx},
+    [RAW_BGRX] = {4, pixel_bgrx, encode_span_bgrx},
+};
+
+/*
+ * Parallel encoding. The serial encoder's state before pixel s is a function
+ * of the input alone: prev is pixel s-1 and each index slot holds the last
+ * pixel before s that hashed to it (run pixels equal the pixel that opened
+ * the run, which was stored, so they do not change the answer). The only
+ * exception is the leading run of pixels equal to the initial prev, which is
+ * never stored. Segment starts are moved forward until pixel s differs from
+ * pixel s-1, so no run crosses a boundary and each segment's chunking of runs
+ * is the one the serial encoder would produce.
+ *
+ * Each segment's index is seeded in two steps so no pixel is scanned twice:
+ * the slots last written inside the previous segment are found by a backward
+ * scan that never leaves that segment, then the remaining slots are inherited
+ * from the previous segment's own seed, in order.
+ */
+struct encode_segment {
+  const struct raw_image *img;
+  const struct raw_layout *layout;
+  u64 scan_begin; // first pixel of the previous segment the index can see
+  u64 begin;
+  u64 end;
+  struct qoi_pixel array[64];
+  bool filled[64];
+  u8 *out;
+  u64 len;
+};
+
+static void *seed_segment_worker(void *arg) {
+  struct encode_segment *seg = arg;
+  u64 seen = 0;
+  for (u64 k = seg->begin; k > seg->scan_begin && seen < 64; k--) {
+    struct qoi_pixel p = seg->layout->pixel(seg->img, k - 1);
+    u8 h = hash(p);
+    if (!seg->filled[h]) {
+      seg->filled[h] = true;
+      seg->array[h] = p;
+      seen++;
     }
+  }
+  return NULL;
+}
+
+static void *encode_segment_worker(void *arg) {
+  struct encode_segment *seg = arg;
+  struct qoi_pixel prev = {0, 0, 0, 255};
+  if (seg->begin > 0)
+    prev = seg->layout->pixel(seg->img, seg->begin - 1);
+  seg->out = big_alloc(4 * (seg->end - seg->begin) + 1);
+  if (seg->out == NULL)
+    return NULL;
+  seg->len = seg->layout->encode_span(seg->img, seg->begin, seg->end, &prev,
+                                      seg->array, seg->out);
+  return NULL;
+}
 
-    // QOI_OP_RGB case
-    (*qoi_buffer)[j++] = 0xFE;
-    (*qoi_buffer)[j++] = curr.r;
-    (*qoi_buffer)[j++] = curr.g;
-    (*qoi_buffer)[j++] = curr.b;
-    prev = curr;
+// runs `fn` on every segment, the first one on the calling thread, and on
+// the calling thread too for any segment whose thread could not be started
+static void run_segments(struct encode_segment *segs, u32 n,
+                         void *(*fn)(void *)) {
+  pthread_t tids[n];
+  bool started[n];
+  for (u32 k = 1; k < n; k++)
+    started[k] = pthread_create(&tids[k], NULL, fn, &segs[k]) == 0;
+  fn(&segs[0]);
+  for (u32 k = 1; k < n; k++) {
+    if (started[k])
+      pthread_join(tids[k], NULL);
+    else
+      fn(&segs[k]);
+  }
+}
+
+static long encode_pixels(const struct raw_image *img, u32 height,
+                          enum raw_format format, u8 **qoi_buffer,
+                          u32 threads) {
+  const struct raw_layout *layout = &raw_layouts[format];
+  u32 width = img->width;
+  u64 total = (u64)width * height;
+  u64 capacity;
+  if (__builtin_mul_overflow(total, 5, &capacity) ||
+      __builtin_add_overflow(capacity, sizeof(struct qoi_header) + 11,
+                             &capacity)) {
+    error("Image too large to encode: %ux%u", width, height);
+    return -1;
+  }
+  bool owned = *qoi_buffer == NULL;
+  *qoi_buffer = owned ? big_alloc(capacity) : *qoi_buffer;
+  if (*qoi_buffer == NULL) {
+    error("Failed to allocate %lu bytes for the QOI output", capacity);
+    return -1;
+  }
+  memcpy(*qoi_buffer,
+         &(struct qoi_header){.magic = {'q', 'o', 'i', 'f'},
+                              .width = width,
+                              .height = height,
+                              .channels = 3,
+                              .colorspace = 0},
+         sizeof(struct qoi_header));
+  u64 j = 14;
+
+  threads = threads > ENCODE_MAX_THREADS ? ENCODE_MAX_THREADS : threads;
+  if (threads <= 1 || total < (u64)threads * ENCODE_MIN_SEGMENT) {
+    struct qoi_pixel prev = (struct qoi_pixel){0, 0, 0, 255};
+    struct qoi_pixel array[64] = {0};
+    j += layout->encode_span(img, 0, total, &prev, array, *qoi_buffer + j);
+  } else {
+    const struct qoi_pixel start = {0, 0, 0, 255};
+    // pixels before this never entered the index
+    u64 floor = 0;
+    while (floor < total && eq_qoi(layout->pixel(img, floor), start))
+      floor++;
+
+    struct encode_segment segs[threads];
+    u32 n = 0;
+    u64 begin = 0, prev_begin = 0;
+    for (u32 k = 1; k <= threads && begin < total; k++) {
+      u64 end = k == threads ? total : total / threads * k;
+      if (end < begin)
+        end = begin;
+      while (end < total && end > 0 &&
+             eq_qoi(layout->pixel(img, end), layout->pixel(img, end - 1)))
+        end++;
+      segs[n++] = (struct encode_segment){
+          .img = img,
+          .layout = layout,
+          .scan_begin = prev_begin > floor ? prev_begin : floor,
+          .begin = begin,
+          .end = end};
+      prev_begin = begin;
+      begin = end;
+    }
+
+    run_segments(segs, n, seed_segment_worker);
+    for (u32 k = 1; k < n; k++)
+      for (u32 h = 0; h < 64; h++)
+        if (!segs[k].filled[h])
+          segs[k].array[h] = segs[k - 1].array[h];
+    run_segments(segs, n, encode_segment_worker);
+
+    bool failed = false;
+    for (u32 k = 0; k < n; k++) {
+      if (segs[k].out == NULL) {
+        failed = true;
+        continue;
+      }
+      memcpy(*qoi_buffer + j, segs[k].out, segs[k].len);
+      j += segs[k].len;
+      big_free(segs[k].out);
+    }
+    if (failed) {
+      error("Failed to allocate the encoder's segment buffers");
+      if (owned) {
+        big_free(*qoi_buffer);
+        *qoi_buffer = NULL;
+      }
+      return -1;
+    }
   }
-  
 
   // end marker
   (*qoi_buffer)[j] = 0;
@@ -149,3 +391,178 @@ long encode(u8 *p6_buffer, u32 p6_size, u8 **qoi_buffer) {
 
   return j + 8;
 }
+
+long encode(u8 *p6_buffer, u64 p6_size, u8 **qoi_buffer) {
+  return encode_parallel(p6_buffer, p6_size, qoi_buffer, 1);
+}
+
+long encode_parallel(u8 *p6_buffer, u64 p6_size, u8 **qoi_buffer,
+                     u32 threads) {
+  u32 width, height;
+  struct p6_pixel *p6_pixel_vec =
+      p6_pixels(p6_buffer, p6_size, &width, &height);
+  if (p6_pixel_vec == NULL)
+    return -1;
+  struct raw_image img = {(const u8 *)p6_pixel_vec, width, (u64)width * 3};
+  return encode_pixels(&img, height, RAW_RGB, qoi_buffer, threads);
+}
+
+long encode_raw(const u8 *pixels, u32 width, u32 height, u64 stride,
+                enum raw_format format, u8 **qoi_buffer, u32 threads) {
+  if ((unsigned)format >= sizeof(raw_layouts) / sizeof(raw_layouts[0])) {
+    error("Unknown raw pixel format %d", format);
+    return -1;
+  }
+  u64 row = (u64)width * raw_layouts[format].bpp;
+  stride = stride == 0 ? row : stride;
+  if (stride < row) {
+    error("Row stride %lu is shorter than a %u pixel row", stride, width);
+    return -1;
+  }
+  struct raw_image img = {pixels, width, stride};
+  return encode_pixels(&img, height, format, qoi_buffer, threads);
+}
+
+static inline i16 clamp_i16(i16 v, i16 lo, i16 hi) {
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+// worst channel error of `cand` against `orig`
+static inline u8 max_error(struct qoi_pixel cand, struct p6_pixel orig) {
+  i16 er = abs((i16)cand.r - orig.r), eg = abs((i16)cand.g - orig.g),
+      eb = abs((i16)cand.b - orig.b);
+  return er > eg ? (er > eb ? er : eb) : (eg > eb ? eg : eb);
+}
+
+// squared distance of `cand` to the error-diffused target
+static inline u32 target_dist(struct qoi_pixel cand, const i16 t[3]) {
+  i32 r = cand.r - t[0], g = cand.g - t[1], b = cand.b - t[2];
+  return r * r + g * g + b * b;
+}
+
+/*
+ * Rewrites the pixels, in place, to values the encoder can emit with the
+ * cheapest op whose result stays within `tolerance` of the source on every
+ * channel: a run of prev, then an index hit, then DIFF, then LUMA. The encoder
+ * state (prev and the index array) is simulated on the reconstructed values so
+ * the decoder sees exactly what was chosen and errors never compound. The
+ * residual of each pixel is carried into the target of the next one along the
+ * row (1D error diffusion, clamped to the tolerance).
+ */
+static void quantize_near_lossless(struct p6_pixel *px, u32 width, u32 height,
+                                   u8 tolerance,
+                                   struct near_lossless_stats *stats) {
+  const i16 n = tolerance;
+  struct qoi_pixel prev = {0, 0, 0, 255};
+  struct qoi_pixel array[64] = {0};
+  u64 sq_error = 0;
+  u8 worst = 0;
+
+  for (u32 y = 0; y < height; y++) {
+    i16 carry[3] = {0, 0, 0};
+    for (u32 x = 0; x < width; x++) {
+      struct p6_pixel orig = px[(u64)y * width + x];
+      i16 t[3] = {clamp_i16(orig.r + carry[0], orig.r - n, orig.r + n),
+                  clamp_i16(orig.g + carry[1], orig.g - n, orig.g + n),
+                  clamp_i16(orig.b + carry[2], orig.b - n, orig.b + n)};
+      struct qoi_pixel chosen;
+      bool found = false;
+
+      // QOI_OP_RUN
+      if (max_error(prev, orig) <= n) {
+        chosen = prev;
+        found = true;
+      }
+
+      // QOI_OP_INDEX, every live slot holds a pixel whose hash is its slot
+      if (!found) {
+        u32 best = UINT32_MAX;
+        for (u8 k = 0; k < 64; k++) {
+          if (array[k].a != 255 || max_error(array[k], orig) > n)
+            continue;
+          u32 d = target_dist(array[k], t);
+          if (d < best) {
+            best = d;
+            chosen = array[k];
+            found = true;
+          }
+        }
+      }
+
+      // QOI_OP_DIFF
+      if (!found) {
+        struct qoi_pixel cand = {
+            prev.r + clamp_i16(t[0] - prev.r, -2, 1),
+            prev.g + clamp_i16(t[1] - prev.g, -2, 1),
+            prev.b + clamp_i16(t[2] - prev.b, -2, 1), 255};
+        if (max_error(cand, orig) <= n) {
+          chosen = cand;
+          found = true;
+        }
+      }
+
+      // QOI_OP_LUMA
+      if (!found) {
+        i16 vardg = clamp_i16(t[1] - prev.g, -32, 31);
+        i16 dr_dg = clamp_i16(t[0] - prev.r - vardg, -8, 7);
+        i16 db_dg = clamp_i16(t[2] - prev.b - vardg, -8, 7);
+        struct qoi_pixel cand = {prev.r + vardg + dr_dg, prev.g + vardg,
+                                 prev.b + vardg + db_dg, 255};
+        if (max_error(cand, orig) <= n) {
+          chosen = cand;
+          found = true;
+        }
+      }
+
+      // QOI_OP_RGB
+      if (!found)
+        chosen = (struct qoi_pixel){clamp_i16(t[0], 0, 255),
+                                    clamp_i16(t[1], 0, 255),
+                                    clamp_i16(t[2], 0, 255), 255};
+
+      carry[0] = clamp_i16(t[0] - chosen.r, -n, n);
+      carry[1] = clamp_i16(t[1] - chosen.g, -n, n);
+      carry[2] = clamp_i16(t[2] - chosen.b, -n, n);
+
+      i32 er = chosen.r - orig.r, eg = chosen.g - orig.g,
+          eb = chosen.b - orig.b;
+      sq_error += er * er + eg * eg + eb * eb;
+      u8 e = max_error(chosen, orig);
+      worst = e > worst ? e : worst;
+
+      // runs leave the index alone, every other op stores the pixel
+      if (!eq_qoi(chosen, prev))
+        array[hash(chosen)] = chosen;
+      prev = chosen;
+      px[(u64)y * width + x] = from_qoi_pixel(chosen);
+    }
+  }
+
+  u64 samples = (u64)width * height * 3;
+  stats->max_error = worst;
+  stats->mse = samples ? (double)sq_error / samples : 0;
+  stats->psnr = stats->mse > 0 ? 10 * log10(255.0 * 255.0 / stats->mse) : INFINITY;
+}
+
+long encode_near_lossless(u8 *p6_buffer, u64 p6_size, u8 **qoi_buffer,
+                          u8 tolerance, struct near_lossless_stats *stats,
+                          u32 threads) {
+  *stats = (struct near_lossless_stats){0};
+  u32 width, height;
+  struct p6_pixel *source = p6_pixels(p6_buffer, p6_size, &width, &height);
+  if (source == NULL)
+    return -1;
+  // the quantizer rewrites pixels, leave the caller's buffer alone
+  u64 bytes = (u64)width * height * sizeof(struct p6_pixel);
+  struct p6_pixel *p6_pixel_vec = big_alloc(bytes);
+  if (p6_pixel_vec == NULL) {
+    error("Failed to allocate %lu bytes for the quantized pixels", bytes);
+    return -1;
+  }
+  memcpy(p6_pixel_vec, source, bytes);
+  quantize_near_lossless(p6_pixel_vec, width, height, tolerance, stats);
+  struct raw_image img = {(const u8 *)p6_pixel_vec, width, (u64)width * 3};
+  long len = encode_pixels(&img, height, RAW_RGB, qoi_buffer, threads);
+  big_free(p6_pixel_vec);
+  return len;
+}
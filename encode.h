@@ -4,6 +4,26 @@
 
 #include "types.h"
 
-long encode(u8* p6_buffer, u32 size, u8** qoi_buffer);  // NOTE: you must free the output of encode later in your code
+// upper bound on the threads any encoder will start
+#define ENCODE_MAX_THREADS 256
+
+// raw framebuffer layouts accepted by encode_raw(), alpha is not encoded
+enum raw_format {
+  RAW_RGB,  // 3 bytes per pixel
+  RAW_BGRA, // 4 bytes per pixel
+  RAW_BGRX, // 4 bytes per pixel, the fourth is padding
+};
+
+struct near_lossless_stats {
+  u8 max_error; // worst per-channel error
+  double mse;
+  double psnr;  // dB, INFINITY when the output is exact
+};
+
+// all encoders return -1 on malformed input or when the image is too large
+long encode(u8* p6_buffer, u64 size, u8** qoi_buffer);  // NOTE: you must big_free() the output of encode later in your code
+long encode_parallel(u8* p6_buffer, u64 size, u8** qoi_buffer, u32 threads); // byte-identical to encode()
+long encode_near_lossless(u8* p6_buffer, u64 size, u8** qoi_buffer, u8 tolerance, struct near_lossless_stats* stats, u32 threads); // standard QOI, every channel within tolerance
+long encode_raw(const u8* pixels, u32 width, u32 height, u64 stride, enum raw_format format, u8** qoi_buffer, u32 threads); // stride in bytes, 0 for tightly packed rows
 
 #endif
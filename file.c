@@ -0,0 +1,40 @@
+#include "file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc.h"
+
+u8* read_file(const char* path, u64* size){
+  int fd = open(path, O_RDONLY);
+  if ( fd < 0 ) return NULL;
+  struct stat st;
+  if ( fstat(fd, &st) != 0 ){
+    close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+  u8* data = big_alloc(*size ? *size : 1);
+  if ( data == NULL ){
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  u64 done = 0;
+  while ( done < *size ){
+    ssize_t n = pread(fd, data + done, *size - done, done);
+    if ( n < 0 && errno == EINTR ) continue;
+    if ( n <= 0 ){
+      int err = n == 0 ? EIO : errno; // EOF early: the file shrank under us
+      big_free(data);
+      close(fd);
+      errno = err;
+      return NULL;
+    }
+    done += n;
+  }
+  close(fd);
+  return data;
+}
@@ -0,0 +1,13 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "types.h"
+
+/*
+ * Reads a whole file into a buffer from big_alloc(). Returns NULL with errno
+ * set on failure; an empty file gives a valid buffer and *size 0.
+ * NOTE: you must big_free() the result
+ */
+u8* read_file(const char* path, u64* size);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "types.h"
+
+// 64-bit FNV-1a, used for pack file names
+static inline u64 fnv1a64(const void* data, size_t len){
+  const u8* bytes = data;
+  u64 h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++){
+    h ^= bytes[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+static inline u64 mix64(u64 x){
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline u64 rotl64(u64 x, int r){
+  return (x << r) | (x >> (64 - r));
+}
+
+// 64-bit content hash for whole files, four independent lanes to keep the multipliers busy
+static inline u64 content_hash(const void* data, size_t len){
+  const u8* bytes = data;
+  u64 lanes[4] = {0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull, 0x94d049bb133111ebull, len};
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32){
+    for (int k = 0; k < 4; k++){
+      u64 w;
+      memcpy(&w, bytes + i + 8 * k, sizeof(w));
+      lanes[k] = rotl64(lanes[k] ^ (w * 0x9e3779b97f4a7c15ull), 29) * 0xbf58476d1ce4e5b9ull;
+    }
+  }
+  u64 h = mix64(lanes[0]) ^ rotl64(mix64(lanes[1]), 17) ^ rotl64(mix64(lanes[2]), 31) ^ rotl64(mix64(lanes[3]), 47);
+  for (; i < len; i++) h = (h ^ bytes[i]) * 0x100000001b3ull;
+  return mix64(h ^ len);
+}
+
+#endif
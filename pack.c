@@ -0,0 +1,207 @@
+#include "pack.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pretty.h>
+
+#include "hash.h"
+
+#define align_up(x) (((x) + QOI_PACK_ALIGN - 1) & ~(u64)(QOI_PACK_ALIGN - 1))
+
+struct sort_item {
+  u64 hash;
+  const struct pack_input* input;
+};
+
+static inline int compare_key(u64 h1, const char* n1, u64 h2, const char* n2){
+  if ( h1 != h2 ) return h1 < h2 ? -1 : 1;
+  return strcmp(n1, n2);
+}
+
+static int compare_items(const void* a, const void* b){
+  const struct sort_item* x = a;
+  const struct sort_item* y = b;
+  return compare_key(x->hash, x->input->name, y->hash, y->input->name);
+}
+
+long pack_build(struct pack_input* inputs, u64 count, u8** pack_buffer){
+  u64 table_size;
+  if ( __builtin_mul_overflow(count, sizeof(struct qoi_pack_entry), &table_size) || table_size > LONG_MAX ){
+    error("Too many images for one pack: %lu", count);
+    return -1;
+  }
+  struct sort_item* items = malloc(count * sizeof(struct sort_item));
+  if ( items == NULL && count > 0 ){
+    error("Failed to allocate the pack index for %lu images", count);
+    return -1;
+  }
+  u64 names_size = 0;
+  for (u64 i = 0; i < count; i++){
+    items[i] = (struct sort_item){fnv1a64(inputs[i].name, strlen(inputs[i].name)), &inputs[i]};
+    names_size += strlen(inputs[i].name) + 1;
+  }
+  // entries address the names with 32-bit offsets and lengths
+  if ( names_size > UINT32_MAX ){
+    error("Pack name table is %lu bytes, more than a pack can address", names_size);
+    free(items);
+    return -1;
+  }
+  qsort(items, count, sizeof(struct sort_item), compare_items);
+  for (u64 i = 1; i < count; i++){
+    if ( compare_items(&items[i - 1], &items[i]) == 0 ){
+      error("Duplicate image name in pack: %s", items[i].input->name);
+      free(items);
+      return -1;
+    }
+  }
+
+  u64 entries_offset = align_up(sizeof(struct qoi_pack_header));
+  u64 names_offset = align_up(entries_offset + table_size);
+  u64 data_offset = align_up(names_offset + names_size);
+  u64 total = data_offset;
+  // every step stays below LONG_MAX, so align_up() cannot wrap either
+  for (u64 i = 0; i < count && total <= LONG_MAX; i++)
+    total = items[i].input->size > LONG_MAX - total ? (u64)LONG_MAX + 1 : align_up(total + items[i].input->size);
+  if ( total > LONG_MAX ){
+    error("Pack would exceed %ld bytes", LONG_MAX);
+    free(items);
+    return -1;
+  }
+
+  u8* out = calloc(total, 1);
+  if ( out == NULL ){
+    error("Failed to allocate %lu bytes for the pack", total);
+    free(items);
+    return -1;
+  }
+  memcpy(out,
+         &(struct qoi_pack_header){.magic = {'q', 'o', 'i', 'p'},
+                                   .version = QOI_PACK_VERSION,
+                                   .count = count,
+                                   .entries_offset = entries_offset,
+                                   .names_offset = names_offset,
+                                   .data_offset = data_offset},
+         sizeof(struct qoi_pack_header));
+
+  struct qoi_pack_entry* entries = (struct qoi_pack_entry*)(out + entries_offset);
+  u64 name_cursor = 0, data_cursor = data_offset;
+  for (u64 i = 0; i < count; i++){
+    const struct pack_input* in = items[i].input;
+    u64 len = strlen(in->name);
+    entries[i] = (struct qoi_pack_entry){
+      .hash = items[i].hash,
+      .offset = data_cursor,
+      .size = in->size,
+      .name_offset = name_cursor,
+      .name_len = len,
+    };
+    memcpy(out + names_offset + name_cursor, in->name, len + 1);
+    memcpy(out + data_cursor, in->data, in->size);
+    name_cursor += len + 1;
+    data_cursor = align_up(data_cursor + in->size);
+  }
+
+  free(items);
+  *pack_buffer = out;
+  return total;
+}
+
+// every offset and length in the table is checked once here, so lookups and
+// readers can trust the entries without touching anything past the mapping
+static bool pack_valid(const u8* base, u64 size){
+  const struct qoi_pack_header* header = (const struct qoi_pack_header*)base;
+  u64 table_size, table_end;
+  if ( !is_pack(base) || header->version != QOI_PACK_VERSION
+       || __builtin_mul_overflow(header->count, sizeof(struct qoi_pack_entry), &table_size)
+       || __builtin_add_overflow(header->entries_offset, table_size, &table_end)
+       || header->entries_offset < sizeof(struct qoi_pack_header)
+       || table_end > header->names_offset
+       || header->names_offset > header->data_offset
+       || header->data_offset > size )
+    return false;
+
+  const struct qoi_pack_entry* entries = (const struct qoi_pack_entry*)(base + header->entries_offset);
+  const char* names = (const char*)(base + header->names_offset);
+  u64 names_size = header->data_offset - header->names_offset;
+  for (u64 i = 0; i < header->count; i++){
+    const struct qoi_pack_entry* e = &entries[i];
+    u64 end;
+    // the name must be non-empty, free of NULs and terminated inside the names section
+    if ( e->name_len == 0 || (u64)e->name_offset + e->name_len >= names_size
+         || names[(u64)e->name_offset + e->name_len] != '\0'
+         || memchr(names + e->name_offset, '\0', e->name_len) != NULL )
+      return false;
+    if ( e->offset < header->data_offset
+         || __builtin_add_overflow(e->offset, e->size, &end) || end > size )
+      return false;
+    // pack_find() relies on the order and on the stored hash
+    if ( e->hash != fnv1a64(names + e->name_offset, e->name_len) ) return false;
+    if ( i > 0 && compare_key(entries[i - 1].hash, names + entries[i - 1].name_offset,
+                              e->hash, names + e->name_offset) >= 0 )
+      return false;
+  }
+  return true;
+}
+
+bool pack_open(const char* path, struct qoi_pack* pack){
+  int fd = open(path, O_RDONLY);
+  if ( fd < 0 ) return false;
+  struct stat st;
+  if ( fstat(fd, &st) != 0 || (u64)st.st_size < sizeof(struct qoi_pack_header) ){
+    close(fd);
+    return false;
+  }
+  u8* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if ( base == MAP_FAILED ) return false;
+
+  const struct qoi_pack_header* header = (const struct qoi_pack_header*)base;
+  if ( !pack_valid(base, st.st_size) ){
+    error("%s is not a valid QOI pack file", path);
+    munmap(base, st.st_size);
+    return false;
+  }
+  // lookups touch the table of contents first, streams are read in whatever order callers ask for
+  madvise(base, st.st_size, MADV_RANDOM);
+
+  *pack = (struct qoi_pack){
+    .base = base,
+    .size = st.st_size,
+    .count = header->count,
+    .entries = (const struct qoi_pack_entry*)(base + header->entries_offset),
+    .names = (const char*)(base + header->names_offset),
+  };
+  return true;
+}
+
+void pack_close(struct qoi_pack* pack){
+  if ( pack->base != NULL ) munmap(pack->base, pack->size);
+  pack->base = NULL;
+}
+
+const char* pack_entry_name(const struct qoi_pack* pack, u64 index){
+  return pack->names + pack->entries[index].name_offset;
+}
+
+const u8* pack_find(const struct qoi_pack* pack, const char* name, u64* size){
+  u64 h = fnv1a64(name, strlen(name));
+  u64 lo = 0, hi = pack->count;
+  while ( lo < hi ){
+    u64 mid = lo + (hi - lo) / 2;
+    int c = compare_key(pack->entries[mid].hash, pack_entry_name(pack, mid), h, name);
+    if ( c == 0 ){
+      *size = pack->entries[mid].size;
+      return pack->base + pack->entries[mid].offset;
+    }
+    if ( c < 0 ) lo = mid + 1;
+    else hi = mid;
+  }
+  return NULL;
+}
@@ -0,0 +1,65 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdbool.h>
+
+#include "types.h"
+
+/*
+ * Pack file layout (all integers little endian, every section 64-byte aligned):
+ *
+ *   struct qoi_pack_header
+ *   struct qoi_pack_entry[count]   sorted by (hash, name)
+ *   names                          NUL terminated, referenced by name_offset
+ *   QOI streams                    each starting on a 64-byte boundary
+ *
+ * Offsets are absolute so that a single read-only mmap of the file is all a
+ * reader needs; images are decoded straight out of the mapping.
+ */
+
+#define QOI_PACK_ALIGN 64
+#define QOI_PACK_VERSION 1
+
+struct qoi_pack_header {
+  char magic[4]; // "qoip"
+  u32 version;
+  u64 count;
+  u64 entries_offset;
+  u64 names_offset;
+  u64 data_offset;
+  u8 reserved[24];
+} __attribute__((packed));
+
+struct qoi_pack_entry {
+  u64 hash; // fnv1a64 of the name
+  u64 offset;
+  u64 size;
+  u32 name_offset; // relative to names_offset
+  u32 name_len;
+} __attribute__((packed));
+
+struct qoi_pack {
+  u8* base;
+  u64 size;
+  u64 count;
+  const struct qoi_pack_entry* entries;
+  const char* names;
+};
+
+struct pack_input {
+  const char* name;
+  const u8* data; // a complete QOI stream
+  u64 size;
+};
+
+static inline bool is_pack(const u8* buffer){
+  return buffer[0] == 'q' && buffer[1] == 'o' && buffer[2] == 'i' && buffer[3] == 'p';
+}
+
+long pack_build(struct pack_input* inputs, u64 count, u8** pack_buffer); // NOTE: you must free the output of pack_build later in your code
+bool pack_open(const char* path, struct qoi_pack* pack); // validates every entry, false on a malformed pack
+void pack_close(struct qoi_pack* pack);
+const u8* pack_find(const struct qoi_pack* pack, const char* name, u64* size); // O(log n), points into the mapping
+const char* pack_entry_name(const struct qoi_pack* pack, u64 index);
+
+#endif
@@ -0,0 +1,201 @@
+#include "tensor.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pretty.h>
+
+#include "alloc.h"
+#include "decode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+  #define TENSOR_AVX2 1
+#else
+  #define TENSOR_AVX2 0
+#endif
+
+// every channel is a byte, so the whole per-sample pipeline collapses into one table per channel
+struct tensor_lut {
+  float f32[3 * 256];
+  u16 f16[3 * 256 + 2]; // padded, the AVX2 path gathers 32 bits per entry
+};
+
+static u16 f32_to_f16(float f){
+  u32 x;
+  memcpy(&x, &f, sizeof(x));
+  u32 sign = (x >> 16) & 0x8000;
+  i32 exp = (i32)((x >> 23) & 0xFF) - 127 + 15;
+  u32 mant = x & 0x7FFFFF;
+  if ( ((x >> 23) & 0xFF) == 0xFF ) return sign | 0x7C00 | (mant ? 0x200 : 0);
+  if ( exp >= 31 ) return sign | 0x7C00;
+  if ( exp <= 0 ){
+    if ( exp < -10 ) return sign;
+    mant |= 0x800000;
+    u32 shift = 14 - exp;
+    u32 half = mant >> shift, rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+    if ( rem > mid || (rem == mid && (half & 1)) ) half++;
+    return sign | half;
+  }
+  u32 half = sign | (exp << 10) | (mant >> 13);
+  u32 rem = mant & 0x1FFF;
+  if ( rem > 0x1000 || (rem == 0x1000 && (half & 1)) ) half++;
+  return half;
+}
+
+static void build_lut(const struct tensor_opts* opts, struct tensor_lut* lut){
+  for (u32 c = 0; c < 3; c++){
+    for (u32 v = 0; v < 256; v++){
+      float x = v / 255.0f;
+      if ( opts->srgb_to_linear )
+        x = x <= 0.04045f ? x / 12.92f : powf((x + 0.055f) / 1.055f, 2.4f);
+      x = (x - opts->mean[c]) / opts->std[c];
+      lut->f32[c * 256 + v] = x;
+      lut->f16[c * 256 + v] = f32_to_f16(x);
+    }
+  }
+  lut->f16[3 * 256] = lut->f16[3 * 256 + 1] = 0;
+}
+
+/* SCALAR */
+
+static void convert_row_hwc(const u8* rgb, u32 width, const struct tensor_lut* lut, enum tensor_dtype dtype, void* dst){
+  u64 n = (u64)width * 3;
+  if ( dtype == TENSOR_F32 )
+    for (u64 k = 0; k < n; k++) ((float*)dst)[k] = lut->f32[(k % 3) * 256 + rgb[k]];
+  else
+    for (u64 k = 0; k < n; k++) ((u16*)dst)[k] = lut->f16[(k % 3) * 256 + rgb[k]];
+}
+
+static void convert_row_chw(const u8* rgb, u32 width, const struct tensor_lut* lut, enum tensor_dtype dtype, void* planes[3]){
+  for (u32 c = 0; c < 3; c++){
+    if ( dtype == TENSOR_F32 )
+      for (u32 x = 0; x < width; x++) ((float*)planes[c])[x] = lut->f32[c * 256 + rgb[3 * x + c]];
+    else
+      for (u32 x = 0; x < width; x++) ((u16*)planes[c])[x] = lut->f16[c * 256 + rgb[3 * x + c]];
+  }
+}
+
+#if TENSOR_AVX2
+
+/* AVX2: 8 table lookups per gather, the tail falls back to the scalar loop */
+
+__attribute__((target("avx2")))
+static inline void store8(__m256i idx, const struct tensor_lut* lut, enum tensor_dtype dtype, void* dst){
+  if ( dtype == TENSOR_F32 ){
+    _mm256_storeu_ps(dst, _mm256_i32gather_ps(lut->f32, idx, 4));
+  } else {
+    __m256i v = _mm256_and_si256(_mm256_i32gather_epi32((const int*)lut->f16, idx, 2), _mm256_set1_epi32(0xFFFF));
+    _mm_storeu_si128(dst, _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+  }
+}
+
+__attribute__((target("avx2")))
+static void convert_row_hwc_avx2(const u8* rgb, u32 width, const struct tensor_lut* lut, enum tensor_dtype dtype, void* dst){
+  u64 n = (u64)width * 3, k = 0;
+  u64 elem = dtype == TENSOR_F32 ? 4 : 2;
+  // channel of lane j is (k + j) % 3, and k % 3 cycles through 0, 2, 1 in steps of 8
+  const __m256i offsets[3] = {
+    _mm256_setr_epi32(0, 256, 512, 0, 256, 512, 0, 256),
+    _mm256_setr_epi32(256, 512, 0, 256, 512, 0, 256, 512),
+    _mm256_setr_epi32(512, 0, 256, 512, 0, 256, 512, 0),
+  };
+  for (; k + 8 <= n; k += 8){
+    __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(rgb + k)));
+    store8(_mm256_add_epi32(idx, offsets[k % 3]), lut, dtype, (u8*)dst + k * elem);
+  }
+  for (; k < n; k++){
+    if ( dtype == TENSOR_F32 ) ((float*)dst)[k] = lut->f32[(k % 3) * 256 + rgb[k]];
+    else ((u16*)dst)[k] = lut->f16[(k % 3) * 256 + rgb[k]];
+  }
+}
+
+// `rgb` must have 4 readable bytes past the last pixel, the byte gathers load 32 bits
+__attribute__((target("avx2")))
+static void convert_row_chw_avx2(const u8* rgb, u32 width, const struct tensor_lut* lut, enum tensor_dtype dtype, void* planes[3]){
+  u64 elem = dtype == TENSOR_F32 ? 4 : 2;
+  const __m256i stride3 = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  const __m256i low_byte = _mm256_set1_epi32(0xFF);
+  for (u32 c = 0; c < 3; c++){
+    const __m256i table = _mm256_set1_epi32(c * 256);
+    u32 x = 0;
+    for (; x + 8 <= width; x += 8){
+      __m256i where = _mm256_add_epi32(_mm256_set1_epi32(3 * x + c), stride3);
+      __m256i bytes = _mm256_and_si256(_mm256_i32gather_epi32((const int*)rgb, where, 1), low_byte);
+      store8(_mm256_add_epi32(bytes, table), lut, dtype, (u8*)planes[c] + (u64)x * elem);
+    }
+    for (; x < width; x++){
+      if ( dtype == TENSOR_F32 ) ((float*)planes[c])[x] = lut->f32[c * 256 + rgb[3 * x + c]];
+      else ((u16*)planes[c])[x] = lut->f16[c * 256 + rgb[3 * x + c]];
+    }
+  }
+}
+
+#endif
+
+long decode_tensor(u8* qoi_buffer, u64 qoi_size, const struct tensor_opts* opts, void** tensor, u32* width, u32* height){
+  if ( !qoi_read_header(qoi_buffer, qoi_size, width, height) ) return -1;
+  u64 elem = opts->dtype == TENSOR_F32 ? 4 : 2;
+  u64 plane = (u64)*width * *height;
+  u64 size;
+  if ( __builtin_mul_overflow(plane, 3 * elem, &size) ){
+    error("Image too large to convert: %ux%u", *width, *height);
+    return -1;
+  }
+
+  struct tensor_lut lut;
+  build_lut(opts, &lut);
+#if TENSOR_AVX2
+  bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+  u8* out = *tensor = big_alloc(size);
+  if ( out == NULL ){
+    error("Failed to allocate %lu bytes for the tensor", size);
+    return -1;
+  }
+  u8* row = malloc(3 * (u64)*width + 4);
+  if ( row == NULL ){
+    error("Failed to allocate a %u pixel row", *width);
+    big_free(out);
+    *tensor = NULL;
+    return -1;
+  }
+  struct qoi_decoder decoder;
+  qoi_decoder_init(&decoder, qoi_buffer, qoi_size);
+
+  // decode one row at a time so the RGB intermediate stays in cache
+  for (u32 y = 0; y < *height; y++){
+    if ( !qoi_decode_rgb(&decoder, row, *width) ){
+      error("QOI stream ends before its last pixel");
+      free(row);
+      big_free(out);
+      *tensor = NULL;
+      return -1;
+    }
+    if ( opts->layout == TENSOR_HWC ){
+      void* dst = out + (u64)y * *width * 3 * elem;
+#if TENSOR_AVX2
+      if ( avx2 ){
+        convert_row_hwc_avx2(row, *width, &lut, opts->dtype, dst);
+        continue;
+      }
+#endif
+      convert_row_hwc(row, *width, &lut, opts->dtype, dst);
+    } else {
+      void* planes[3];
+      for (u32 c = 0; c < 3; c++) planes[c] = out + (c * plane + (u64)y * *width) * elem;
+#if TENSOR_AVX2
+      if ( avx2 ){
+        convert_row_chw_avx2(row, *width, &lut, opts->dtype, planes);
+        continue;
+      }
+#endif
+      convert_row_chw(row, *width, &lut, opts->dtype, planes);
+    }
+  }
+
+  free(row);
+  return size;
+}
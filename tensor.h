@@ -0,0 +1,28 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+#include <stdbool.h>
+
+#include "types.h"
+
+enum tensor_dtype { TENSOR_F32, TENSOR_F16 };
+enum tensor_layout { TENSOR_CHW, TENSOR_HWC };
+
+/*
+ * Each channel value v is mapped to ((srgb_to_linear ? linear(v / 255) : v / 255) - mean[c]) / std[c]
+ * and stored as dtype, planar (CHW) or interleaved (HWC).
+ */
+struct tensor_opts {
+  enum tensor_dtype dtype;
+  enum tensor_layout layout;
+  bool srgb_to_linear;
+  float mean[3];
+  float std[3];
+};
+
+#define TENSOR_OPTS_DEFAULT                                                    \
+  ((struct tensor_opts){TENSOR_F32, TENSOR_CHW, false, {0, 0, 0}, {1, 1, 1}})
+
+long decode_tensor(u8* qoi_buffer, u64 qoi_size, const struct tensor_opts* opts, void** tensor, u32* width, u32* height); // NOTE: you must big_free() the output of decode_tensor later in your code
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Hand-assembled QOI streams for decoder bugs that round trips through our
+ * own encoder never hit. Each case lists the pixels the stream must decode
+ * to; a non-zero exit status means a case failed.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "../alloc.h"
+#include "../decode.h"
+
+#define HASH_RGBA(r, g, b, a) (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) & 63)
+#define HASH(r, g, b) HASH_RGBA(r, g, b, 255)
+#define END_MARKER 0, 0, 0, 0, 0, 0, 0, 1
+
+struct decode_case {
+  const char* name;
+  const u8* ops; // everything after the header
+  u64 size;
+  const u8* expected; // packed RGB, width 4 and height 1
+};
+
+// a QOI_OP_RUN right after a QOI_OP_INDEX repeats the indexed pixel, the
+// decoder used to repeat the pixel before it (40 50 60)
+static const u8 index_then_run[] = {
+  0xFE, 10, 20, 30,
+  0xFE, 40, 50, 60,
+  HASH(10, 20, 30),
+  0xC0,
+  END_MARKER,
+};
+static const u8 index_then_run_rgb[] = {10, 20, 30, 40, 50, 60, 10, 20, 30, 10, 20, 30};
+
+// a QOI_OP_RGBA is 5 bytes, the decoder used to stay on it and leave every
+// later pixel unwritten
+static const u8 rgba_op[] = {
+  0xFF, 1, 2, 3, 255,
+  0xFE, 4, 5, 6,
+  0xC1,
+  END_MARKER,
+};
+static const u8 rgba_op_rgb[] = {1, 2, 3, 4, 5, 6, 4, 5, 6, 4, 5, 6};
+
+// the index slot of a QOI_OP_RGBA pixel depends on its alpha, the decoder
+// used to hash every pixel as opaque and look up the wrong slot
+static const u8 rgba_then_index[] = {
+  0xFF, 7, 8, 9, 128,
+  0xFE, 40, 50, 60,
+  HASH_RGBA(7, 8, 9, 128),
+  0xC0,
+  END_MARKER,
+};
+static const u8 rgba_then_index_rgb[] = {7, 8, 9, 40, 50, 60, 7, 8, 9, 7, 8, 9};
+
+static const struct decode_case cases[] = {
+  {"index_then_run", index_then_run, sizeof(index_then_run), index_then_run_rgb},
+  {"rgba_op", rgba_op, sizeof(rgba_op), rgba_op_rgb},
+  {"rgba_then_index", rgba_then_index, sizeof(rgba_then_index), rgba_then_index_rgb},
+};
+
+int main(void){
+  static const char p6_header[] = "P6\n4 1\n255\n";
+  int failed = 0;
+  for (unsigned k = 0; k < sizeof(cases) / sizeof(cases[0]); k++){
+    const struct decode_case* c = &cases[k];
+    u8 stream[64];
+    memcpy(stream,
+           &(struct qoi_header){.magic = {'q', 'o', 'i', 'f'}, .width = 4, .height = 1, .channels = 3},
+           sizeof(struct qoi_header));
+    memcpy(stream + sizeof(struct qoi_header), c->ops, c->size);
+    u8* p6 = NULL;
+    long len = decode(stream, sizeof(struct qoi_header) + c->size, &p6);
+    if ( len != (long)(sizeof(p6_header) - 1 + 12)
+         || memcmp(p6, p6_header, sizeof(p6_header) - 1) != 0
+         || memcmp(p6 + sizeof(p6_header) - 1, c->expected, 12) != 0 ){
+      printf("FAIL %s\n", c->name);
+      failed = 1;
+    } else {
+      printf("ok   %s\n", c->name);
+    }
+    if ( p6 != NULL ) big_free(p6);
+  }
+  return failed;
+}
@@ -1,258 +1,744 @@
 #include <SDL3/SDL.h>
 
 
-#include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <pretty.h>
 
+#include "alloc.h"
 #include "types.h"
 #include "decode.h"
+#include "file.h"
+
+// parses the "P6\nW H\nMAX\n" header written by decode() and returns the offset of the pixel data,
+// 0 when the header is malformed or fewer than width * height pixels follow it
+static u64 p6_header(const u8* buffer, u64 size, u32* width, u32* height){
+  if ( size < 3 || buffer[0] != 'P' || buffer[1] != '6' || buffer[2] != '\n' ) return 0;
+  u64 i = 3, w = 0, h = 0;
+  while ( i < size && buffer[i] >= '0' && buffer[i] <= '9' && w <= UINT32_MAX ){
+    w = w * 10 + buffer[i] - '0';
+    i++;
+  }
+  if ( i >= size || buffer[i] != ' ' ) return 0;
+  i++;
+  while ( i < size && buffer[i] >= '0' && buffer[i] <= '9' && h <= UINT32_MAX ){
+    h = h * 10 + buffer[i] - '0';
+    i++;
+  }
+  if ( i >= size || buffer[i] != '\n' ) return 0;
+  i++;
+  while ( i < size && buffer[i] != '\n' ) i++;
+  i++;
+  u64 bytes;
+  if ( i > size || w == 0 || h == 0 || w > UINT32_MAX || h > UINT32_MAX
+       || __builtin_mul_overflow(w * h, 3, &bytes) || bytes > size - i )
+    return 0;
+  *width = w;
+  *height = h;
+  return i;
+}
 
-static inline void update_texture_from_surface(SDL_Texture* texture, SDL_Surface* surface){
-  
-  float tex_w, tex_h;
-  SDL_GetTextureSize(texture, &tex_w, &tex_h);
-    
-  void* pixels;
-  int pitch;
-  u32 bbp = SDL_GetPixelFormatDetails(surface->format) -> bytes_per_pixel;
-    
-  if ( SDL_LockTexture(texture, NULL, &pixels, &pitch) )
-    for (int y = 0; y < surface->h; y++) {
-      char* src_row = (char*)surface->pixels + (y * surface->pitch);
-      char* dst_row = (char*)pixels + (y * pitch);
-      memcpy(dst_row, src_row, surface->w*bbp);
+/* MIPMAPS */
+
+struct mip_level {
+  u32 width;
+  u32 height;
+  u8* rgb;     // packed RGB24 rows, level 0 points at the caller's pixels
+};
+
+// 2x2 box filter, odd edges reuse the last row/column
+static struct mip_level downsample(const struct mip_level* src){
+  struct mip_level dst = {(src->width + 1) / 2, (src->height + 1) / 2, NULL};
+  dst.rgb = big_alloc((u64)dst.width * dst.height * 3);
+  if ( dst.rgb == NULL ) return dst;
+  for (u32 y = 0; y < dst.height; y++){
+    const u8* r0 = src->rgb + (u64)(2 * y) * src->width * 3;
+    const u8* r1 = 2 * y + 1 < src->height ? r0 + (u64)src->width * 3 : r0;
+    u8* out = dst.rgb + (u64)y * dst.width * 3;
+    for (u32 x = 0; x < dst.width; x++){
+      u32 x0 = 2 * x * 3, x1 = 2 * x + 1 < src->width ? x0 + 3 : x0;
+      for (u32 c = 0; c < 3; c++)
+        out[3 * x + c] = (r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) / 4;
     }
-  SDL_UnlockTexture(texture); 
+  }
+  return dst;
 }
 
-
-static inline void set_pixel(SDL_Surface* surface, SDL_Palette* palette, u32 x, u32 y, u8 r, u8 g, u8 b){ 
-  char* pixel = surface->pixels + y * surface->pitch + x * 4; 
-  SDL_PixelFormatDetails *pfd = SDL_GetPixelFormatDetails(surface -> format); 
-  u32 color = SDL_MapRGBA(pfd, palette, r, g, b, 255);
-  *(uint *)pixel = color;
-
+/* TILED VIEWER */
+
+// tiles are square textures of this size, only those intersecting the viewport get uploaded
+#define TILE_SIZE 512
+#define TILE_POOL 256
+// uploads per frame, the rest are drawn from coarser levels until the next frame
+#define TILE_UPLOADS_PER_FRAME 12
+#define MAX_MIP_LEVELS 32
+#define VIEWER_MAX_WINDOW_W 1600
+#define VIEWER_MAX_WINDOW_H 1000
+
+struct tile_slot {
+  SDL_Texture* texture;
+  i32 level;     // -1 when empty
+  u32 tx;
+  u32 ty;
+  u64 last_used;
+};
+
+struct tiled_view {
+  struct mip_level levels[MAX_MIP_LEVELS];
+  u32 n_levels;
+  u32 tile;      // min(TILE_SIZE, renderer limit)
+  struct tile_slot slots[TILE_POOL];
+  u64 frame;
+  float zoom;    // screen pixels per image pixel
+  float ox;      // image coordinates of the top-left corner of the window
+  float oy;
+};
+
+static struct tile_slot* find_tile(struct tiled_view* view, u32 level, u32 tx, u32 ty){
+  for (u32 i = 0; i < TILE_POOL; i++){
+    struct tile_slot* slot = &view->slots[i];
+    if ( slot->level == (i32)level && slot->tx == tx && slot->ty == ty ) return slot;
+  }
+  return NULL;
 }
 
-static inline void set_pixels(SDL_Surface* surface, SDL_Palette* palette, u32 width, u32 height, u8* buffer){
-  if ( SDL_SURFACE_LOCK_NEEDED ) {
-    SDL_LockSurface(surface);
+// uploads a tile into the least recently drawn slot, never one already used in this frame
+static struct tile_slot* upload_tile(struct tiled_view* view, SDL_Renderer* renderer, u32 level, u32 tx, u32 ty){
+  struct tile_slot* victim = NULL;
+  for (u32 i = 0; i < TILE_POOL; i++){
+    struct tile_slot* slot = &view->slots[i];
+    if ( slot->last_used == view->frame && slot->level >= 0 ) continue;
+    if ( victim == NULL || slot->last_used < victim->last_used ) victim = slot;
   }
-  
-  for(uint y = 0; y < height; y++) {
-    for (uint x = 0; x < width; x++) {
-      uint ppm_index = (y * width + x) * 3;
-      
-      // Read RGB values from PPM buffer
-      char r = buffer[ppm_index];
-      char g = buffer[ppm_index + 1];
-      char b = buffer[ppm_index + 2];
-      
-      // Set pixel in surface (converts to RGBA8888)
-      set_pixel(surface, palette, x, y, r, g, b);
+  if ( victim == NULL ) return NULL;
+  if ( victim->texture == NULL ){
+    victim->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, view->tile, view->tile);
+    if ( victim->texture == NULL ){
+      error("Error creating a texture!: %s", SDL_GetError());
+      return NULL;
     }
   }
-  
-  if (SDL_SURFACE_LOCK_NEEDED) SDL_UnlockSurface(surface);
-
+  const struct mip_level* l = &view->levels[level];
+  u32 x0 = tx * view->tile, y0 = ty * view->tile;
+  SDL_Rect rect = {0, 0, SDL_min(view->tile, l->width - x0), SDL_min(view->tile, l->height - y0)};
+  SDL_UpdateTexture(victim->texture, &rect, l->rgb + ((u64)y0 * l->width + x0) * 3, l->width * 3);
+  victim->level = level;
+  victim->tx = tx;
+  victim->ty = ty;
+  victim->last_used = view->frame;
+  return victim;
 }
 
-void display_ppm_p6(u8* buffer){
-  if (!SDL_Init(SDL_INIT_VIDEO)){
-    error("Error initializing the video subsystem for SDL3!: %s", SDL_GetError());
-    exit(EXIT_FAILURE);
+// draws the visible tiles of one level, returns false when some could not be uploaded yet
+static bool draw_level(struct tiled_view* view, SDL_Renderer* renderer, u32 level, int out_w, int out_h, u32* budget){
+  const struct mip_level* l = &view->levels[level];
+  float scale = (float)(1u << level);           // level pixels -> image pixels
+  float span = view->tile * scale;              // one tile in image pixels
+  float x_min = view->ox > 0 ? view->ox : 0, y_min = view->oy > 0 ? view->oy : 0;
+  float x_max = view->ox + out_w / view->zoom, y_max = view->oy + out_h / view->zoom;
+  if ( x_max <= x_min || y_max <= y_min ) return true;
+
+  u32 tiles_x = (l->width + view->tile - 1) / view->tile, tiles_y = (l->height + view->tile - 1) / view->tile;
+  u32 tx0 = x_min / span, ty0 = y_min / span;
+  u32 tx1 = SDL_min((u32)(x_max / span), tiles_x - 1), ty1 = SDL_min((u32)(y_max / span), tiles_y - 1);
+  bool complete = true;
+
+  for (u32 ty = ty0; ty <= ty1; ty++){
+    for (u32 tx = tx0; tx <= tx1; tx++){
+      struct tile_slot* slot = find_tile(view, level, tx, ty);
+      if ( slot == NULL && *budget > 0 ){
+        slot = upload_tile(view, renderer, level, tx, ty);
+        (*budget)--;
+      }
+      if ( slot == NULL ){
+        complete = false;
+        continue;
+      }
+      slot->last_used = view->frame;
+      u32 w = SDL_min(view->tile, l->width - tx * view->tile), h = SDL_min(view->tile, l->height - ty * view->tile);
+      SDL_FRect src = {0, 0, w, h};
+      SDL_FRect dst = {
+        .x = (tx * span - view->ox) * view->zoom,
+        .y = (ty * span - view->oy) * view->zoom,
+        .w = w * scale * view->zoom,
+        .h = h * scale * view->zoom,
+      };
+      SDL_SetTextureScaleMode(slot->texture, view->zoom >= 1 ? SDL_SCALEMODE_NEAREST : SDL_SCALEMODE_LINEAR);
+      SDL_RenderTexture(renderer, slot->texture, &src, &dst);
+    }
   }
+  return complete;
+}
 
-  assert(buffer[0] == 'P' && buffer[1] == '6' && buffer[2] == '\n');
+// returns true when the frame is missing tiles and another one should follow
+static bool render_view(struct tiled_view* view, SDL_Renderer* renderer){
+  int out_w, out_h;
+  SDL_GetRenderOutputSize(renderer, &out_w, &out_h);
+  view->frame++;
 
-  u32 width = 0, height = 0;
-  u64 i = 3;
-  while(buffer[i] != ' '){
-    width = width * 10 + buffer[i] - '0';
-    i++;
-  }
-  i++;
+  // the finest level with at most one texel per screen pixel
+  u32 level = 0;
+  while ( level + 1 < view->n_levels && (float)(2u << level) <= 1 / view->zoom ) level++;
 
-  while(buffer[i] != '\n'){
-    height = height * 10 + buffer[i] - '0';
-    i++;
-  }
-  i++;
+  u32 budget = TILE_UPLOADS_PER_FRAME;
+  SDL_RenderClear(renderer);
+  // the coarsest level is a handful of tiles and stands in for anything not uploaded yet
+  bool complete = true;
+  if ( level != view->n_levels - 1 )
+    complete &= draw_level(view, renderer, view->n_levels - 1, out_w, out_h, &budget);
+  complete &= draw_level(view, renderer, level, out_w, out_h, &budget);
+  SDL_RenderPresent(renderer);
+  return !complete;
+}
 
-  SDL_Window* win = SDL_CreateWindow("P6 Viewer", width, height, SDL_WINDOW_RESIZABLE | SDL_WINDOW_BORDERLESS);
-  if ( win == NULL ){
-    error("Error Creating a Window!: %s", SDL_GetError());
-    SDL_Quit();
+static void fit_view(struct tiled_view* view, SDL_Renderer* renderer){
+  int out_w, out_h;
+  SDL_GetRenderOutputSize(renderer, &out_w, &out_h);
+  float sx = (float)out_w / view->levels[0].width, sy = (float)out_h / view->levels[0].height;
+  view->zoom = sx < sy ? sx : sy;
+  view->ox = -(out_w / view->zoom - view->levels[0].width) / 2;
+  view->oy = -(out_h / view->zoom - view->levels[0].height) / 2;
+}
+
+// zooms by `factor` keeping the image point under (sx, sy) in place
+static void zoom_view(struct tiled_view* view, float factor, float sx, float sy){
+  float zoom = view->zoom * factor;
+  if ( zoom < 1.0f / (1u << (view->n_levels + 1)) || zoom > 64 ) return;
+  view->ox += sx / view->zoom - sx / zoom;
+  view->oy += sy / view->zoom - sy / zoom;
+  view->zoom = zoom;
+}
+
+/*
+ * Shows an RGB24 image of any size: a mipmap pyramid is built up front and
+ * the window renders it through a pool of fixed-size tile textures. Mouse
+ * wheel zooms around the cursor, dragging pans, 0/f fits, 1 is 100%.
+ */
+static void view_image(const char* title, u32 width, u32 height, u8* rgb){
+  if (!SDL_Init(SDL_INIT_VIDEO)){
+    error("Error initializing the video subsystem for SDL3!: %s", SDL_GetError());
     exit(EXIT_FAILURE);
   }
 
-  SDL_Surface* surface = SDL_CreateSurface(width, height, SDL_PIXELFORMAT_RGBA8888);
-  if ( surface == NULL ){
-    error("Error creating a Surface!: %s", SDL_GetError());
-    SDL_DestroyWindow(win);
+  float fit = SDL_min(1.0f, SDL_min((float)VIEWER_MAX_WINDOW_W / width, (float)VIEWER_MAX_WINDOW_H / height));
+  SDL_Window* win = SDL_CreateWindow(title, SDL_max(1, (int)(width * fit)), SDL_max(1, (int)(height * fit)), SDL_WINDOW_RESIZABLE | SDL_WINDOW_BORDERLESS);
+  if ( win == NULL ){
+    error("Error Creating a Window!: %s", SDL_GetError());
     SDL_Quit();
     exit(EXIT_FAILURE);
   }
 
-
   SDL_Renderer* renderer = SDL_CreateRenderer(win, NULL);
   if ( renderer == NULL ){
     error("Error creating a renderer!: %s", SDL_GetError());
-    SDL_DestroySurface(surface);
     SDL_DestroyWindow(win);
     SDL_Quit();
     exit(EXIT_FAILURE);
   }
-
-  SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
-  if ( texture == NULL ){
-    error("Error creating a texture!: %s", SDL_GetError());
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroySurface(surface);
-    SDL_DestroyWindow(win);
-    SDL_Quit();
-    exit(EXIT_FAILURE);
-  }
-  SDL_Palette* palette = SDL_CreatePalette(256);
-  if (palette == NULL){
-    error("Error creating a Palette!: %s", SDL_GetError());
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroySurface(surface);
-    SDL_DestroyWindow(win);
-    SDL_Quit();
-    exit(EXIT_FAILURE); 
+  SDL_SetRenderVSync(renderer, 1);
+
+  struct tiled_view* view = calloc(1, sizeof(struct tiled_view));
+  i64 max_texture = SDL_GetNumberProperty(SDL_GetRendererProperties(renderer), SDL_PROP_RENDERER_MAX_TEXTURE_SIZE_NUMBER, TILE_SIZE);
+  view->tile = max_texture > 0 && max_texture < TILE_SIZE ? max_texture : TILE_SIZE;
+  for (u32 i = 0; i < TILE_POOL; i++) view->slots[i].level = -1;
+
+  view->levels[0] = (struct mip_level){width, height, rgb};
+  view->n_levels = 1;
+  while ( view->n_levels < MAX_MIP_LEVELS ){
+    const struct mip_level* top = &view->levels[view->n_levels - 1];
+    if ( top->width <= view->tile && top->height <= view->tile ) break;
+    struct mip_level next = downsample(top);
+    if ( next.rgb == NULL ) break;
+    view->levels[view->n_levels++] = next;
   }
-  
-  set_pixels(surface, palette, width, height, buffer);
-
-  SDL_RenderClear(renderer);
-  update_texture_from_surface(texture, surface);
-  SDL_RenderTexture(renderer, texture, NULL, NULL);
-  SDL_RenderPresent(renderer);
+  fit_view(view, renderer);
 
   SDL_Event event;
-  bool run = true;
+  bool run = true, dragging = false, pending = true;
 
   while ( run ){
-    SDL_PollEvent(&event);
-    switch(event.type){
-      case SDL_EVENT_QUIT:
-      case SDL_EVENT_WINDOW_CLOSE_REQUESTED:
-        run = false; 
-        break;
-      default:
+    // keep drawing while tiles are still streaming in, otherwise sleep until something happens
+    bool got = pending ? SDL_PollEvent(&event) : SDL_WaitEvent(&event);
+    if ( got ){
+      switch(event.type){
+        case SDL_EVENT_QUIT:
+        case SDL_EVENT_WINDOW_CLOSE_REQUESTED:
+          run = false;
+          break;
+        case SDL_EVENT_WINDOW_RESIZED:
+        case SDL_EVENT_WINDOW_EXPOSED:
+          pending = true;
+          break;
+        case SDL_EVENT_MOUSE_WHEEL:
+          zoom_view(view, event.wheel.y > 0 ? 1.25f : 0.8f, event.wheel.mouse_x, event.wheel.mouse_y);
+          pending = true;
+          break;
+        case SDL_EVENT_MOUSE_BUTTON_DOWN:
+        case SDL_EVENT_MOUSE_BUTTON_UP:
+          if ( event.button.button == SDL_BUTTON_LEFT ) dragging = event.type == SDL_EVENT_MOUSE_BUTTON_DOWN;
+          break;
+        case SDL_EVENT_MOUSE_MOTION:
+          if ( dragging ){
+            view->ox -= event.motion.xrel / view->zoom;
+            view->oy -= event.motion.yrel / view->zoom;
+            pending = true;
+          }
+          break;
+        case SDL_EVENT_KEY_DOWN:
+          switch(event.key.key){
+            case SDLK_ESCAPE:
+            case SDLK_Q:
+              run = false;
+              break;
+            case SDLK_0:
+            case SDLK_F:
+              fit_view(view, renderer);
+              pending = true;
+              break;
+            case SDLK_1: {
+              int out_w, out_h;
+              SDL_GetRenderOutputSize(renderer, &out_w, &out_h);
+              zoom_view(view, 1 / view->zoom, out_w / 2.0f, out_h / 2.0f);
+              pending = true;
+              break;
+            }
+            default:
+          }
+          break;
+        default:
+      }
+      // drain the queue before drawing so a fast wheel or drag costs one frame
+      if ( pending ) continue;
     }
+    if ( pending && run ) pending = render_view(view, renderer);
   }
 
-  SDL_DestroyPalette(palette);
-  SDL_DestroyTexture(texture);
+  for (u32 i = 0; i < TILE_POOL; i++)
+    if ( view->slots[i].texture != NULL ) SDL_DestroyTexture(view->slots[i].texture);
+  for (u32 i = 1; i < view->n_levels; i++) big_free(view->levels[i].rgb);
+  free(view);
   SDL_DestroyRenderer(renderer);
-  SDL_DestroySurface(surface);
   SDL_DestroyWindow(win);
   SDL_Quit();
 }
 
+void display_ppm_p6(u8* buffer, u64 size){
+  u32 width, height;
+  u64 i = p6_header(buffer, size, &width, &height);
+  if ( i == 0 ){
+    error("Malformed P6 header or truncated pixel data");
+    exit(EXIT_FAILURE);
+  }
+  view_image("P6 Viewer", width, height, buffer + i);
+}
+
+void display_qoi(u8* buffer, u64 size){
+  u8* p6_buffer = NULL;
+  long len = decode(buffer, size, &p6_buffer);
+  if ( len < 0 ) exit(EXIT_FAILURE);
+  u32 width, height;
+  u64 i = p6_header(p6_buffer, len, &width, &height);
+  if ( i == 0 ){
+    error("Decoded image is empty");
+    big_free(p6_buffer);
+    exit(EXIT_FAILURE);
+  }
+  view_image("QOI Viewer", width, height, p6_buffer + i);
+  big_free(p6_buffer);
+}
+
+/* SLIDESHOW */
+
+enum slide_state { SLIDE_EMPTY, SLIDE_QUEUED, SLIDE_DECODING, SLIDE_READY, SLIDE_FAILED };
+
+struct slide {
+  const char* path;
+  enum slide_state state;
+  u8* data;       // buffer owning the decoded image (P6 as produced by decode())
+  u8* pixels;     // RGB24 rows inside data
+  u32 width;
+  u32 height;
+  SDL_Texture* texture;
+  u64 last_used;
+};
+
+struct slideshow {
+  struct slide* slides;
+  u32 count;
+  u32 current;
+  u32 prefetch;
+  u64 cache_bytes;
+  u64 cache_used;
+  u64 clock;
+  u32 max_texture; // larger slides are downsampled before upload
+  u32 ready_event;
+  bool quit;
+  SDL_Mutex* lock;
+  SDL_Condition* wake;
+};
+
+#define SLIDESHOW_MAX_WORKERS 4
+
+// reads and decodes one slide, the format is sniffed from the magic bytes rather than the extension
+static bool load_slide(const char* path, u8** data, u8** pixels, u32* width, u32* height){
+  u64 size = 0;
+  u8* buffer = read_file(path, &size);
+  if ( buffer == NULL || size < 14 ){
+    big_free(buffer);
+    return false;
+  }
+  if ( buffer[0] == 'q' && buffer[1] == 'o' && buffer[2] == 'i' && buffer[3] == 'f' ){
+    u8* p6_buffer = NULL;
+    long len = decode(buffer, size, &p6_buffer);
+    big_free(buffer);
+    if ( len < 0 ) return false;
+    buffer = p6_buffer;
+    size = len;
+  }
+  u64 offset = p6_header(buffer, size, width, height);
+  if ( offset == 0 ){
+    big_free(buffer);
+    return false;
+  }
+  *data = buffer;
+  *pixels = buffer + offset;
+  return true;
+}
+
+// halves the slide until it fits in a single texture of the renderer
+static bool fit_texture_limit(u32 max_texture, u8** data, u8** pixels, u32* width, u32* height){
+  while ( *width > max_texture || *height > max_texture ){
+    struct mip_level next = downsample(&(struct mip_level){*width, *height, *pixels});
+    if ( next.rgb == NULL ) return false;
+    big_free(*data);
+    *data = *pixels = next.rgb;
+    *width = next.width;
+    *height = next.height;
+  }
+  return true;
+}
 
+static inline u32 slide_distance(const struct slideshow* show, u32 a, u32 b){
+  u32 d = a > b ? a - b : b - a;
+  return d < show->count - d ? d : show->count - d;
+}
 
+static inline bool in_prefetch_window(const struct slideshow* show, u32 index){
+  return slide_distance(show, index, show->current) <= show->prefetch;
+}
 
-void display_qoi(u8* buffer){
-  u8* p6_buffer;
-  decode(buffer, &p6_buffer);
-  if (!SDL_Init(SDL_INIT_VIDEO)){
-    error("Error initializing the video subsystem for SDL3!: %s", SDL_GetError());
-    exit(EXIT_FAILURE);
+static int slideshow_worker(void* data){
+  struct slideshow* show = data;
+  SDL_LockMutex(show->lock);
+  while ( !show->quit ){
+    // always pick the queued slide closest to the one on screen
+    struct slide* next = NULL;
+    u32 best = UINT32_MAX;
+    for (u32 i = 0; i < show->count; i++){
+      if ( show->slides[i].state != SLIDE_QUEUED ) continue;
+      u32 d = slide_distance(show, i, show->current);
+      if ( d < best ){
+        best = d;
+        next = &show->slides[i];
+      }
+    }
+    if ( next == NULL ){
+      SDL_WaitCondition(show->wake, show->lock);
+      continue;
+    }
+    next->state = SLIDE_DECODING;
+    SDL_UnlockMutex(show->lock);
+
+    u8 *buffer = NULL, *pixels = NULL;
+    u32 width = 0, height = 0;
+    bool ok = load_slide(next->path, &buffer, &pixels, &width, &height)
+              && fit_texture_limit(show->max_texture, &buffer, &pixels, &width, &height);
+
+    SDL_LockMutex(show->lock);
+    // the user may have paged past this slide while it was decoding
+    if ( !in_prefetch_window(show, next - show->slides) ){
+      big_free(buffer);
+      next->state = SLIDE_EMPTY;
+      continue;
+    }
+    next->data = buffer;
+    next->pixels = pixels;
+    next->width = width;
+    next->height = height;
+    next->state = ok ? SLIDE_READY : SLIDE_FAILED;
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = show->ready_event;
+    event.user.code = next - show->slides;
+    SDL_PushEvent(&event);
   }
+  SDL_UnlockMutex(show->lock);
+  return 0;
+}
 
-  assert(p6_buffer[0] == 'P' && p6_buffer[1] == '6' && p6_buffer[2] == '\n');
+// evicts least recently used textures until `needed` more bytes fit in the budget.
+// an evicted texture of the requested size is handed back for reuse instead of being destroyed.
+static SDL_Texture* evict_textures(struct slideshow* show, u64 needed, u32 width, u32 height){
+  SDL_Texture* reuse = NULL;
+  while ( show->cache_used + needed > show->cache_bytes ){
+    struct slide* victim = NULL;
+    for (u32 i = 0; i < show->count; i++){
+      struct slide* s = &show->slides[i];
+      if ( s->texture == NULL || i == show->current ) continue;
+      if ( victim == NULL || s->last_used < victim->last_used ) victim = s;
+    }
+    if ( victim == NULL ) break;
+    show->cache_used -= (u64)victim->width * victim->height * 4;
+    if ( reuse == NULL && victim->width == width && victim->height == height )
+      reuse = victim->texture;
+    else
+      SDL_DestroyTexture(victim->texture);
+    victim->texture = NULL;
+  }
+  return reuse;
+}
 
-  u32 width = 0, height = 0;
-  u64 i = 3;
-  while(p6_buffer[i] != ' '){
-    width = width * 10 + p6_buffer[i] - '0';
-    i++;
+// called with the lock held, turns a decoded slide into a cached texture and drops the pixels
+static void upload_slide(struct slideshow* show, SDL_Renderer* renderer, struct slide* s){
+  u64 bytes = (u64)s->width * s->height * 4;
+  SDL_Texture* texture = evict_textures(show, bytes, s->width, s->height);
+  if ( texture == NULL )
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, s->width, s->height);
+  if ( texture == NULL ){
+    error("Error creating a texture for %s!: %s", s->path, SDL_GetError());
+    s->state = SLIDE_FAILED;
+  } else {
+    SDL_UpdateTexture(texture, NULL, s->pixels, s->width * 3);
+    s->texture = texture;
+    s->last_used = ++show->clock;
+    show->cache_used += bytes;
+    s->state = SLIDE_EMPTY;
   }
-  i++;
+  big_free(s->data);
+  s->data = NULL;
+  s->pixels = NULL;
+}
 
-  while(p6_buffer[i] != '\n'){
-    height = height * 10 + p6_buffer[i] - '0';
-    i++;
+// called with the lock held after `current` moved: queue the neighbourhood, forget what fell out of it
+static void schedule_prefetch(struct slideshow* show){
+  for (u32 i = 0; i < show->count; i++){
+    struct slide* s = &show->slides[i];
+    bool wanted = in_prefetch_window(show, i);
+    if ( wanted && s->state == SLIDE_EMPTY && s->texture == NULL )
+      s->state = SLIDE_QUEUED;
+    else if ( !wanted && s->state == SLIDE_QUEUED )
+      s->state = SLIDE_EMPTY;
+    else if ( !wanted && s->state == SLIDE_READY ){
+      big_free(s->data);
+      s->data = NULL;
+      s->pixels = NULL;
+      s->state = SLIDE_EMPTY;
+    }
   }
-  i++;
+  SDL_BroadcastCondition(show->wake);
+}
 
-  SDL_Window* win = SDL_CreateWindow("P6 Viewer", width, height, SDL_WINDOW_RESIZABLE | SDL_WINDOW_BORDERLESS);
-  if ( win == NULL ){
-    error("Error Creating a Window!: %s", SDL_GetError());
-    SDL_Quit();
-    exit(EXIT_FAILURE);
+static void render_slide(SDL_Window* win, SDL_Renderer* renderer, struct slide* s){
+  // a slide that failed to load gets a dark red placeholder rather than the previous frame
+  bool failed = s->texture == NULL && s->state == SLIDE_FAILED;
+  SDL_SetRenderDrawColor(renderer, failed ? 96 : 0, 0, 0, 255);
+  SDL_RenderClear(renderer);
+  if ( failed ){
+    char title[512];
+    SDL_snprintf(title, sizeof(title), "%s (failed to load)", s->path);
+    SDL_SetWindowTitle(win, title);
   }
+  else if ( s->texture != NULL ){
+    int out_w, out_h;
+    SDL_GetRenderOutputSize(renderer, &out_w, &out_h);
+    float sx = (float)out_w / s->width, sy = (float)out_h / s->height;
+    float scale = sx < sy ? sx : sy;
+    SDL_FRect dst = {
+      .x = (out_w - s->width * scale) / 2,
+      .y = (out_h - s->height * scale) / 2,
+      .w = s->width * scale,
+      .h = s->height * scale,
+    };
+    SDL_RenderTexture(renderer, s->texture, NULL, &dst);
+    SDL_SetWindowTitle(win, s->path);
+  }
+  SDL_RenderPresent(renderer);
+}
 
-  SDL_Surface* surface = SDL_CreateSurface(width, height, SDL_PIXELFORMAT_RGBA8888);
-  if ( surface == NULL ){
-    error("Error creating a Surface!: %s", SDL_GetError());
-    SDL_DestroyWindow(win);
-    SDL_Quit();
+void display_files(char** paths, u32 count, u32 prefetch, u64 cache_bytes){
+  if ( count == 0 ){
+    error("No images to display!");
+    exit(EXIT_FAILURE);
+  }
+  if (!SDL_Init(SDL_INIT_VIDEO)){
+    error("Error initializing the video subsystem for SDL3!: %s", SDL_GetError());
     exit(EXIT_FAILURE);
   }
 
-
-  SDL_Renderer* renderer = SDL_CreateRenderer(win, NULL);
-  if ( renderer == NULL ){
-    error("Error creating a renderer!: %s", SDL_GetError());
-    SDL_DestroySurface(surface);
-    SDL_DestroyWindow(win);
+  struct slideshow show = {
+    .slides = calloc(count, sizeof(struct slide)),
+    .count = count,
+    .current = 0,
+    .prefetch = prefetch,
+    .cache_bytes = cache_bytes,
+    .ready_event = SDL_RegisterEvents(1),
+    .lock = SDL_CreateMutex(),
+    .wake = SDL_CreateCondition(),
+  };
+  if ( show.slides == NULL || show.ready_event == 0 || show.lock == NULL || show.wake == NULL ){
+    error("Error setting up the slideshow!: %s", SDL_GetError());
     SDL_Quit();
     exit(EXIT_FAILURE);
   }
-
-  SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
-  if ( texture == NULL ){
-    error("Error creating a texture!: %s", SDL_GetError());
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroySurface(surface);
-    SDL_DestroyWindow(win);
+  for (u32 i = 0; i < count; i++) show.slides[i].path = paths[i];
+
+  // the first image is on the critical path anyway, decode it here to size the window
+  struct slide* first = &show.slides[0];
+  if ( load_slide(first->path, &first->data, &first->pixels, &first->width, &first->height) )
+    first->state = SLIDE_READY;
+  else
+    first->state = SLIDE_FAILED;
+
+  u32 win_w = first->state == SLIDE_READY ? first->width : 640, win_h = first->state == SLIDE_READY ? first->height : 480;
+  float fit = SDL_min(1.0f, SDL_min((float)VIEWER_MAX_WINDOW_W / win_w, (float)VIEWER_MAX_WINDOW_H / win_h));
+  SDL_Window* win = SDL_CreateWindow("P6 Viewer", SDL_max(1, (int)(win_w * fit)), SDL_max(1, (int)(win_h * fit)),
+                                     SDL_WINDOW_RESIZABLE | SDL_WINDOW_BORDERLESS);
+  if ( win == NULL ){
+    error("Error Creating a Window!: %s", SDL_GetError());
     SDL_Quit();
     exit(EXIT_FAILURE);
   }
-  SDL_Palette* palette = SDL_CreatePalette(256);
-  if (palette == NULL){
-    error("Error creating a Palette!: %s", SDL_GetError());
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroySurface(surface);
+
+  SDL_Renderer* renderer = SDL_CreateRenderer(win, NULL);
+  if ( renderer == NULL ){
+    error("Error creating a renderer!: %s", SDL_GetError());
     SDL_DestroyWindow(win);
     SDL_Quit();
-    exit(EXIT_FAILURE); 
+    exit(EXIT_FAILURE);
   }
-  
-  set_pixels(surface, palette, width, height, p6_buffer);
 
-  SDL_RenderClear(renderer);
-  update_texture_from_surface(texture, surface);
-  SDL_RenderTexture(renderer, texture, NULL, NULL);
-  SDL_RenderPresent(renderer);
+  i64 max_texture = SDL_GetNumberProperty(SDL_GetRendererProperties(renderer), SDL_PROP_RENDERER_MAX_TEXTURE_SIZE_NUMBER, 0);
+  show.max_texture = max_texture > 0 ? max_texture : UINT32_MAX;
+  if ( first->state == SLIDE_READY
+       && !fit_texture_limit(show.max_texture, &first->data, &first->pixels, &first->width, &first->height) )
+    first->state = SLIDE_FAILED;
+
+  int cores = SDL_GetNumLogicalCPUCores() - 1;
+  u32 n_workers = cores < 1 ? 1 : cores > SLIDESHOW_MAX_WORKERS ? SLIDESHOW_MAX_WORKERS : cores;
+  SDL_Thread* workers[SLIDESHOW_MAX_WORKERS] = {0};
+  for (u32 i = 0; i < n_workers; i++)
+    workers[i] = SDL_CreateThread(slideshow_worker, "slide decoder", &show);
+
+  SDL_LockMutex(show.lock);
+  if ( first->state == SLIDE_READY ) upload_slide(&show, renderer, first);
+  if ( first->state == SLIDE_FAILED ) error("Failed to load %s", first->path);
+  schedule_prefetch(&show);
+  render_slide(win, renderer, first);
+  SDL_UnlockMutex(show.lock);
 
   SDL_Event event;
   bool run = true;
 
   while ( run ){
-    SDL_PollEvent(&event);
+    if ( !SDL_WaitEvent(&event) ) continue;
+    u32 target = show.current;
+    bool redraw = false, report = false;
+
+    if ( event.type == show.ready_event ){
+      SDL_LockMutex(show.lock);
+      for (u32 i = 0; i < show.count; i++){
+        struct slide* s = &show.slides[i];
+        if ( s->state != SLIDE_READY ) continue;
+        if ( !in_prefetch_window(&show, i) ){
+          big_free(s->data);
+          s->data = NULL;
+          s->pixels = NULL;
+          s->state = SLIDE_EMPTY;
+          continue;
+        }
+        upload_slide(&show, renderer, s);
+        redraw |= i == show.current;
+      }
+      // the slide on screen finished decoding without an image
+      struct slide* current = &show.slides[show.current];
+      if ( (u32)event.user.code == show.current && current->state == SLIDE_FAILED && current->texture == NULL )
+        redraw = report = true;
+      SDL_UnlockMutex(show.lock);
+    }
+
     switch(event.type){
       case SDL_EVENT_QUIT:
       case SDL_EVENT_WINDOW_CLOSE_REQUESTED:
-        run = false; 
+        run = false;
+        break;
+      case SDL_EVENT_WINDOW_RESIZED:
+      case SDL_EVENT_WINDOW_EXPOSED:
+        redraw = true;
+        break;
+      case SDL_EVENT_KEY_DOWN:
+        switch(event.key.key){
+          case SDLK_ESCAPE:
+          case SDLK_Q:
+            run = false;
+            break;
+          case SDLK_RIGHT:
+          case SDLK_DOWN:
+          case SDLK_SPACE:
+          case SDLK_PAGEDOWN:
+          case SDLK_N:
+            target = (show.current + 1) % show.count;
+            break;
+          case SDLK_LEFT:
+          case SDLK_UP:
+          case SDLK_BACKSPACE:
+          case SDLK_PAGEUP:
+          case SDLK_P:
+            target = (show.current + show.count - 1) % show.count;
+            break;
+          case SDLK_HOME:
+            target = 0;
+            break;
+          case SDLK_END:
+            target = show.count - 1;
+            break;
+          default:
+        }
         break;
       default:
     }
+
+    SDL_LockMutex(show.lock);
+    if ( target != show.current ){
+      show.current = target;
+      schedule_prefetch(&show);
+      redraw = true;
+      report = show.slides[target].state == SLIDE_FAILED;
+    }
+    if ( redraw ){
+      struct slide* s = &show.slides[show.current];
+      if ( s->texture != NULL ) s->last_used = ++show.clock;
+      if ( report ) error("Failed to load %s", s->path);
+      render_slide(win, renderer, s);
+    }
+    SDL_UnlockMutex(show.lock);
   }
 
-  SDL_DestroyPalette(palette);
-  SDL_DestroyTexture(texture);
+  SDL_LockMutex(show.lock);
+  show.quit = true;
+  SDL_BroadcastCondition(show.wake);
+  SDL_UnlockMutex(show.lock);
+  for (u32 i = 0; i < n_workers; i++)
+    if ( workers[i] != NULL ) SDL_WaitThread(workers[i], NULL);
+
+  for (u32 i = 0; i < count; i++){
+    if ( show.slides[i].texture != NULL ) SDL_DestroyTexture(show.slides[i].texture);
+    big_free(show.slides[i].data);
+  }
+  free(show.slides);
+  SDL_DestroyCondition(show.wake);
+  SDL_DestroyMutex(show.lock);
   SDL_DestroyRenderer(renderer);
-  SDL_DestroySurface(surface);
   SDL_DestroyWindow(win);
   SDL_Quit();
-  free(p6_buffer);
 }
@@ -4,7 +4,8 @@
 
 #include "types.h"
 
-void display_ppm_p6(u8* buffer);
-void display_qoi(u8* buffer);
+void display_ppm_p6(u8* buffer, u64 size);
+void display_qoi(u8* buffer, u64 size);
+void display_files(char** paths, u32 count, u32 prefetch, u64 cache_bytes); // slideshow over QOI/P6 files
 
 #endif 
@@ -0,0 +1,698 @@
+#define _GNU_SOURCE // ppoll
+#include "watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pretty.h>
+
+#include "alloc.h"
+#include "encode.h"
+#include "file.h"
+#include "hash.h"
+
+#define WATCH_CACHE_FILE ".qoi_tool_cache"
+#define WATCH_EVENT_BUFFER 65536
+#define WATCH_PATH_MAX 4096
+
+// false when "dir/name" does not fit, a truncated path would name another file
+static bool join_path(char path[WATCH_PATH_MAX], const char* dir, const char* name){
+  int n = snprintf(path, WATCH_PATH_MAX, "%s/%s", dir, name);
+  return n >= 0 && n < WATCH_PATH_MAX;
+}
+
+/* CONTENT CACHE: content hash of a P6 input -> the QOI file it was encoded to */
+
+struct cache_entry {
+  u64 hash; // 0 marks an empty slot
+  u64 size;
+  char* output;      // file name inside the output directory
+  u64 output_size;   // the output is trusted only while its size and mtime still match
+  i64 output_mtime_ns;
+};
+
+struct content_cache {
+  struct cache_entry* slots;
+  u64 cap; // power of two
+  u64 used;
+  FILE* log; // append-only, replayed at startup
+  u64 lines; // records in the log, rewritten once they reach twice the entries kept last time
+  u64 kept;
+  const char* out_dir;
+};
+
+static inline i64 mtime_ns(const struct stat* st){
+  return (i64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static struct cache_entry* cache_slot(struct content_cache* cache, u64 hash){
+  u64 i = hash & (cache->cap - 1);
+  while ( cache->slots[i].hash != 0 && cache->slots[i].hash != hash ) i = (i + 1) & (cache->cap - 1);
+  return &cache->slots[i];
+}
+
+static void cache_insert(struct content_cache* cache, struct cache_entry entry){
+  if ( entry.hash == 0 ) entry.hash = 1;
+  if ( (cache->used + 1) * 10 > cache->cap * 7 ){
+    struct cache_entry* old = cache->slots;
+    u64 old_cap = cache->cap;
+    cache->slots = calloc(old_cap * 2, sizeof(struct cache_entry));
+    cache->cap = old_cap * 2;
+    cache->used = 0;
+    for (u64 i = 0; i < old_cap; i++)
+      if ( old[i].hash != 0 ) cache_insert(cache, old[i]);
+    free(old);
+  }
+  struct cache_entry* slot = cache_slot(cache, entry.hash);
+  if ( slot->hash == 0 ) cache->used++;
+  else free(slot->output);
+  *slot = entry;
+}
+
+static bool cache_valid(const char* out_dir, const struct cache_entry* e){
+  char path[WATCH_PATH_MAX];
+  struct stat st;
+  return join_path(path, out_dir, e->output) && stat(path, &st) == 0
+         && (u64)st.st_size == e->output_size && mtime_ns(&st) == e->output_mtime_ns;
+}
+
+static void cache_write_entry(FILE* out, const struct cache_entry* e){
+  fprintf(out, "%016lx %lu %lu %ld %s\n", e->hash, e->size, e->output_size, e->output_mtime_ns, e->output);
+}
+
+// entries whose output was replaced or deleted can never hit again
+static void cache_prune(struct content_cache* cache){
+  struct cache_entry* old = cache->slots;
+  u64 old_cap = cache->cap;
+  cache->slots = calloc(old_cap, sizeof(struct cache_entry));
+  cache->used = 0;
+  for (u64 i = 0; i < old_cap; i++){
+    if ( old[i].hash == 0 ) continue;
+    if ( cache_valid(cache->out_dir, &old[i]) ) cache_insert(cache, old[i]);
+    else free(old[i].output);
+  }
+  free(old);
+}
+
+// rewrites the log with one line per entry through a temporary, the old log
+// stays in place if anything fails
+static void cache_compact(struct content_cache* cache, const char* path){
+  char tmp[WATCH_PATH_MAX];
+  int n = snprintf(tmp, WATCH_PATH_MAX, "%s.XXXXXX", path);
+  if ( n < 0 || n >= WATCH_PATH_MAX ) return;
+  int fd = mkstemp(tmp);
+  if ( fd < 0 ) return;
+  FILE* out = fdopen(fd, "w");
+  if ( out == NULL ){
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  for (u64 i = 0; i < cache->cap; i++)
+    if ( cache->slots[i].hash != 0 ) cache_write_entry(out, &cache->slots[i]);
+  bool ok = fclose(out) == 0;
+  if ( !ok || rename(tmp, path) != 0 ){
+    unlink(tmp);
+    return;
+  }
+  if ( cache->log != NULL ) fclose(cache->log);
+  cache->log = fopen(path, "a");
+  cache->lines = cache->used;
+}
+
+static void cache_open(struct content_cache* cache, const char* out_dir){
+  *cache = (struct content_cache){.slots = calloc(1024, sizeof(struct cache_entry)), .cap = 1024, .out_dir = out_dir};
+  char path[WATCH_PATH_MAX];
+  if ( !join_path(path, out_dir, WATCH_CACHE_FILE) ){
+    error("watch: output directory path too long for the cache, results will not persist");
+    return;
+  }
+
+  FILE* in = fopen(path, "r");
+  if ( in != NULL ){
+    struct cache_entry e;
+    char name[4096];
+    // later lines win, they describe the most recent encode of that content
+    while ( fscanf(in, "%lx %lu %lu %ld %4095[^\n]\n", &e.hash, &e.size, &e.output_size, &e.output_mtime_ns, name) == 5 ){
+      e.output = strdup(name);
+      cache_insert(cache, e);
+      cache->lines++;
+    }
+    fclose(in);
+    cache_prune(cache);
+    cache->kept = cache->used;
+    info("watch: loaded %lu cached encodes from %s", cache->used, path);
+  }
+  cache->log = fopen(path, "a");
+  if ( cache->log == NULL ) error("Failed to open the watch cache %s, results will not persist", path);
+  else if ( cache->lines > cache->used ) cache_compact(cache, path);
+}
+
+static void cache_put(struct content_cache* cache, u64 hash, u64 size, const char* output, const struct stat* st){
+  struct cache_entry e = {hash ? hash : 1, size, strdup(output), st->st_size, mtime_ns(st)};
+  cache_insert(cache, e);
+  if ( cache->log == NULL ) return;
+  cache_write_entry(cache->log, &e);
+  fflush(cache->log);
+  // every re-encode of a name leaves a dead entry and line behind
+  char path[WATCH_PATH_MAX];
+  if ( ++cache->lines >= 2 * cache->kept + 1024 && join_path(path, cache->out_dir, WATCH_CACHE_FILE) ){
+    cache_prune(cache);
+    cache_compact(cache, path);
+    // after a failed rewrite this waits for the log to double again
+    cache->kept = cache->lines;
+  }
+}
+
+// returns the cached output for this content if the file is still the one that was written
+static const char* cache_lookup(struct content_cache* cache, u64 hash, u64 size){
+  struct cache_entry* e = cache_slot(cache, hash ? hash : 1);
+  if ( e->hash == 0 || e->size != size ) return NULL;
+  if ( !cache_valid(cache->out_dir, e) ) return NULL;
+  return e->output;
+}
+
+static void cache_close(struct content_cache* cache){
+  for (u64 i = 0; i < cache->cap; i++) free(cache->slots[i].output);
+  free(cache->slots);
+  if ( cache->log != NULL ) fclose(cache->log);
+}
+
+/* NAME MAP: output file name -> pending entry or job, linear probing */
+
+struct name_slot {
+  const char* key; // NULL marks an empty slot, owned by the value
+  u64 hash;
+  void* value;
+};
+
+struct name_map {
+  struct name_slot* slots;
+  u64 cap; // power of two, 0 until the first insert
+  u64 used;
+};
+
+static struct name_slot* map_slot(const struct name_map* map, const char* key, u64 hash){
+  u64 i = hash & (map->cap - 1);
+  while ( map->slots[i].key != NULL && (map->slots[i].hash != hash || strcmp(map->slots[i].key, key) != 0) )
+    i = (i + 1) & (map->cap - 1);
+  return &map->slots[i];
+}
+
+static void* map_get(const struct name_map* map, const char* key){
+  if ( map->cap == 0 ) return NULL;
+  return map_slot(map, key, fnv1a64(key, strlen(key)))->value;
+}
+
+static void map_put(struct name_map* map, const char* key, void* value){
+  if ( (map->used + 1) * 10 > map->cap * 7 ){
+    struct name_map bigger = {calloc(map->cap ? map->cap * 2 : 64, sizeof(struct name_slot)), map->cap ? map->cap * 2 : 64, 0};
+    for (u64 i = 0; i < map->cap; i++)
+      if ( map->slots[i].key != NULL ) *map_slot(&bigger, map->slots[i].key, map->slots[i].hash) = map->slots[i];
+    bigger.used = map->used;
+    free(map->slots);
+    *map = bigger;
+  }
+  u64 hash = fnv1a64(key, strlen(key));
+  struct name_slot* slot = map_slot(map, key, hash);
+  if ( slot->key == NULL ) map->used++;
+  *slot = (struct name_slot){key, hash, value};
+}
+
+// backward shift deletion, keeps every probe chain intact without tombstones
+static void map_remove(struct name_map* map, const char* key){
+  if ( map->cap == 0 ) return;
+  u64 mask = map->cap - 1;
+  u64 i = map_slot(map, key, fnv1a64(key, strlen(key))) - map->slots;
+  if ( map->slots[i].key == NULL ) return;
+  map->used--;
+  for (u64 j = (i + 1) & mask; map->slots[j].key != NULL; j = (j + 1) & mask){
+    u64 home = map->slots[j].hash & mask;
+    // slot j may move into the hole only if its home is not in (i, j]
+    if ( ((j - home) & mask) >= ((j - i) & mask) ){
+      map->slots[i] = map->slots[j];
+      i = j;
+    }
+  }
+  map->slots[i] = (struct name_slot){0};
+}
+
+/* WORK QUEUE */
+
+struct job {
+  char* name;
+  char* output; // jobs sharing an output never run at the same time
+  u64 first_event_ns; // latency is measured from the first event of the coalesced burst
+  struct job* next;
+};
+
+struct watch_state {
+  const char* dir;
+  const char* out_dir;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct job* head;
+  struct job* tail;
+  struct name_map queued;  // output -> job still in the queue
+  struct name_map running; // output -> job a worker is encoding
+  bool stop;
+  struct content_cache cache;
+  // stats, under lock
+  u64 depth;
+  u64 max_depth;
+  u64 in_flight;
+  u64 encoded;
+  u64 unchanged;
+  u64 duplicates;
+  u64 failed;
+  u64 latency_count;
+  u64 latency_sum_ns;
+  u64 latency_max_ns;
+  u64 reported; // latency_count + depth at the last periodic report
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+static void on_stop(int sig){
+  (void)sig;
+  stop_requested = 1;
+}
+
+static void on_stats(int sig){
+  (void)sig;
+  stats_requested = 1;
+}
+
+static inline u64 now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool is_p6_name(const char* name){
+  const char* ext = strrchr(name, '.');
+  return name[0] != '.' && ext && (strcmp(ext, ".ppm") == 0 || strcmp(ext, ".p6") == 0);
+}
+
+static char* output_name(const char* name){
+  const char* ext = strrchr(name, '.');
+  u64 stem = ext ? (u64)(ext - name) : strlen(name);
+  char* out = malloc(stem + 5);
+  memcpy(out, name, stem);
+  memcpy(out + stem, ".qoi", 5);
+  return out;
+}
+
+// creates a hidden temporary with a unique name next to `name`, -1 on failure
+static int make_temp(const char* out_dir, const char* name, char tmp[WATCH_PATH_MAX]){
+  int n = snprintf(tmp, WATCH_PATH_MAX, "%s/.%s.XXXXXX", out_dir, name);
+  if ( n < 0 || n >= WATCH_PATH_MAX ) return -1;
+  int fd = mkstemp(tmp);
+  // mkstemp creates 0600, the outputs are meant to be read by others
+  if ( fd >= 0 ) fchmod(fd, 0644);
+  return fd;
+}
+
+// writes through a hidden temporary and renames it, readers never see a partial file
+static bool write_atomic(const char* out_dir, const char* name, const u8* data, u64 size){
+  char tmp[WATCH_PATH_MAX], path[WATCH_PATH_MAX];
+  if ( !join_path(path, out_dir, name) ) return false;
+  int fd = make_temp(out_dir, name, tmp);
+  if ( fd < 0 ) return false;
+  FILE* out = fdopen(fd, "wb");
+  if ( out == NULL ){
+    close(fd);
+    unlink(tmp);
+    return false;
+  }
+  bool ok = fwrite(data, 1, size, out) == size;
+  ok &= fclose(out) == 0;
+  if ( ok ) ok = rename(tmp, path) == 0;
+  if ( !ok ) unlink(tmp);
+  return ok;
+}
+
+// a duplicate frame shares the already encoded file, copied when hard links are not possible
+static bool link_duplicate(const char* out_dir, const char* existing, const char* name){
+  char src[WATCH_PATH_MAX], tmp[WATCH_PATH_MAX], path[WATCH_PATH_MAX];
+  if ( !join_path(src, out_dir, existing) || !join_path(path, out_dir, name) ) return false;
+  // the unique name is only reserved, link() needs it free again
+  int fd = make_temp(out_dir, name, tmp);
+  if ( fd >= 0 ){
+    close(fd);
+    unlink(tmp);
+    bool ok = link(src, tmp) == 0 && rename(tmp, path) == 0;
+    // renaming onto a link to the same file succeeds without removing tmp
+    unlink(tmp);
+    if ( ok ) return true;
+  }
+  u64 size;
+  u8* data = read_file(src, &size);
+  if ( data == NULL ) return false;
+  bool ok = write_atomic(out_dir, name, data, size);
+  big_free(data);
+  return ok;
+}
+
+static void process_job(struct watch_state* w, struct job* job){
+  const char* out_name = job->output;
+  enum { DONE_ENCODED, DONE_UNCHANGED, DONE_DUPLICATE, DONE_FAILED } result = DONE_FAILED;
+  u64 size = 0;
+  u8* data = NULL;
+
+  char path[WATCH_PATH_MAX], out_path[WATCH_PATH_MAX];
+  if ( !join_path(path, w->dir, job->name) || !join_path(out_path, w->out_dir, out_name) ){
+    error("watch: path too long, skipping %s", job->name);
+    goto done;
+  }
+
+  data = read_file(path, &size);
+  if ( data == NULL || size < 3 || data[0] != 'P' || data[1] != '6' || data[2] != '\n' ){
+    error("watch: %s is not a readable P6 image", path);
+    goto done;
+  }
+
+  u64 hash = content_hash(data, size);
+  pthread_mutex_lock(&w->lock);
+  const char* cached = cache_lookup(&w->cache, hash, size);
+  char* existing = cached ? strdup(cached) : NULL;
+  pthread_mutex_unlock(&w->lock);
+
+  struct stat st;
+  if ( existing != NULL ){
+    // cache_lookup() only returns names whose path it could build
+    char existing_path[WATCH_PATH_MAX];
+    struct stat existing_st;
+    join_path(existing_path, w->out_dir, existing);
+    if ( strcmp(existing, out_name) == 0 ) result = DONE_UNCHANGED;
+    // already a link to the cached output from an earlier run
+    else if ( stat(out_path, &st) == 0 && stat(existing_path, &existing_st) == 0
+              && st.st_dev == existing_st.st_dev && st.st_ino == existing_st.st_ino ) result = DONE_UNCHANGED;
+    else if ( link_duplicate(w->out_dir, existing, out_name) ){
+      // the new name now holds this content too, later events for it are unchanged
+      if ( stat(out_path, &st) == 0 ){
+        pthread_mutex_lock(&w->lock);
+        cache_put(&w->cache, hash, size, out_name, &st);
+        pthread_mutex_unlock(&w->lock);
+      }
+      result = DONE_DUPLICATE;
+    }
+    free(existing);
+    if ( result != DONE_FAILED ) goto done;
+  }
+
+  u8* encoded = NULL;
+  long len = encode(data, size, &encoded);
+  if ( len < 0 ) goto done;
+  bool written = write_atomic(w->out_dir, out_name, encoded, len);
+  big_free(encoded);
+  if ( !written ){
+    error("watch: failed to write %s/%s", w->out_dir, out_name);
+    goto done;
+  }
+
+  if ( stat(out_path, &st) == 0 ){
+    pthread_mutex_lock(&w->lock);
+    cache_put(&w->cache, hash, size, out_name, &st);
+    pthread_mutex_unlock(&w->lock);
+  }
+  result = DONE_ENCODED;
+
+done:
+  big_free(data);
+  u64 latency = now_ns() - job->first_event_ns;
+  pthread_mutex_lock(&w->lock);
+  w->in_flight--;
+  w->encoded += result == DONE_ENCODED;
+  w->unchanged += result == DONE_UNCHANGED;
+  w->duplicates += result == DONE_DUPLICATE;
+  w->failed += result == DONE_FAILED;
+  w->latency_count++;
+  w->latency_sum_ns += latency;
+  w->latency_max_ns = latency > w->latency_max_ns ? latency : w->latency_max_ns;
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void* watch_worker(void* arg){
+  struct watch_state* w = arg;
+  pthread_mutex_lock(&w->lock);
+  while ( true ){
+    // the oldest job whose output no other worker is writing
+    struct job* prev = NULL;
+    struct job* job = w->head;
+    while ( job != NULL && map_get(&w->running, job->output) != NULL ){
+      prev = job;
+      job = job->next;
+    }
+    if ( job == NULL ){
+      if ( w->head == NULL && w->stop ) break; // stopping, and the queue is drained
+      pthread_cond_wait(&w->wake, &w->lock);
+      continue;
+    }
+    if ( prev ) prev->next = job->next;
+    else w->head = job->next;
+    if ( w->tail == job ) w->tail = prev;
+    map_remove(&w->queued, job->output);
+    map_put(&w->running, job->output, job);
+    w->depth--;
+    w->in_flight++;
+    pthread_mutex_unlock(&w->lock);
+
+    process_job(w, job);
+
+    pthread_mutex_lock(&w->lock);
+    map_remove(&w->running, job->output);
+    // a newer job for the same output may be waiting on this one
+    if ( map_get(&w->queued, job->output) != NULL ) pthread_cond_broadcast(&w->wake);
+    free(job->name);
+    free(job->output);
+    free(job);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+// takes ownership of `name` and `output`, a job still queued for the same output just
+// switches to the newer source
+static void enqueue(struct watch_state* w, char* name, char* output, u64 first_event_ns){
+  pthread_mutex_lock(&w->lock);
+  struct job* queued = map_get(&w->queued, output);
+  if ( queued != NULL ){
+    free(queued->name);
+    queued->name = name;
+    free(output);
+    pthread_mutex_unlock(&w->lock);
+    return;
+  }
+  struct job* job = malloc(sizeof(struct job));
+  *job = (struct job){name, output, first_event_ns, NULL};
+  map_put(&w->queued, job->output, job);
+  if ( w->tail ) w->tail->next = job;
+  else w->head = job;
+  w->tail = job;
+  w->depth++;
+  w->max_depth = w->depth > w->max_depth ? w->depth : w->max_depth;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+}
+
+// periodic reports are skipped while nothing happens
+static void print_stats(struct watch_state* w, bool force){
+  pthread_mutex_lock(&w->lock);
+  if ( !force && w->reported == w->latency_count + w->depth ){
+    pthread_mutex_unlock(&w->lock);
+    return;
+  }
+  w->reported = w->latency_count + w->depth;
+  info("watch: queue %lu (max %lu), in flight %lu, encoded %lu, unchanged %lu, duplicates %lu, failed %lu, latency avg %.1f ms max %.1f ms",
+       w->depth, w->max_depth, w->in_flight, w->encoded, w->unchanged, w->duplicates, w->failed,
+       w->latency_count ? w->latency_sum_ns / 1e6 / w->latency_count : 0.0, w->latency_max_ns / 1e6);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* DEBOUNCE: a file is queued once no event touched it for debounce_ms */
+
+struct pending {
+  char* name;   // the source that saw the latest event
+  char* output; // frame.ppm and frame.p6 share frame.qoi, so they share an entry
+  u64 first_event_ns;
+  u64 deadline_ns;
+};
+
+struct pending_set {
+  struct pending* items;
+  u64 count;
+  u64 cap;
+  struct name_map by_output; // output -> index into items + 1
+};
+
+static void touch_pending(struct pending_set* set, const char* name, u64 now, u64 debounce_ns){
+  char* output = output_name(name);
+  u64 found = (u64)(uintptr_t)map_get(&set->by_output, output);
+  if ( found != 0 ){
+    struct pending* p = &set->items[found - 1];
+    if ( strcmp(p->name, name) != 0 ){
+      free(p->name);
+      p->name = strdup(name);
+    }
+    p->deadline_ns = now + debounce_ns;
+    free(output);
+    return;
+  }
+  if ( set->count == set->cap ){
+    set->cap = set->cap ? set->cap * 2 : 64;
+    set->items = realloc(set->items, set->cap * sizeof(struct pending));
+  }
+  set->items[set->count++] = (struct pending){strdup(name), output, now, now + debounce_ns};
+  map_put(&set->by_output, output, (void*)(uintptr_t)set->count);
+}
+
+// queues everything that went quiet, returns the time until the next deadline (or -1)
+static int flush_pending(struct pending_set* set, struct watch_state* w, u64 now){
+  u64 next = UINT64_MAX;
+  for (u64 i = 0; i < set->count; ){
+    struct pending* p = &set->items[i];
+    if ( p->deadline_ns <= now ){
+      map_remove(&set->by_output, p->output);
+      enqueue(w, p->name, p->output, p->first_event_ns);
+      set->items[i] = set->items[--set->count];
+      if ( i < set->count ) map_put(&set->by_output, set->items[i].output, (void*)(uintptr_t)(i + 1));
+      continue;
+    }
+    next = p->deadline_ns < next ? p->deadline_ns : next;
+    i++;
+  }
+  return next == UINT64_MAX ? -1 : (int)((next - now + 999999) / 1000000);
+}
+
+void watch(const char* dir, const struct watch_opts* opts){
+  struct watch_state w = {
+    .dir = dir,
+    .out_dir = opts->output_dir ? opts->output_dir : dir,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+  };
+  u64 debounce_ns = (u64)opts->debounce_ms * 1000000;
+
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if ( fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ){
+    error("Failed to watch %s: %s", dir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if ( mkdir(w.out_dir, 0755) != 0 && errno != EEXIST ){
+    error("Failed to create the output directory %s: %s", w.out_dir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  cache_open(&w.cache, w.out_dir);
+
+  struct sigaction sa = {0};
+  sa.sa_handler = on_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = on_stats;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  // workers inherit the blocked set, the signals are only taken inside ppoll() below
+  // so they always interrupt the wait instead of landing on a worker
+  sigset_t handled, unblocked;
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGINT);
+  sigaddset(&handled, SIGTERM);
+  sigaddset(&handled, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &handled, &unblocked);
+
+  u32 threads = opts->threads ? opts->threads : 1;
+  pthread_t workers[threads];
+  for (u32 i = 0; i < threads; i++){
+    int err = pthread_create(&workers[i], NULL, watch_worker, &w);
+    if ( err != 0 ){
+      error("watch: failed to start worker %u: %s", i, strerror(err));
+      if ( i == 0 ) exit(EXIT_FAILURE);
+      threads = i;
+      break;
+    }
+  }
+
+  // files already in the spool go through the same path, the cache makes finished ones cheap
+  struct pending_set pending = {0};
+  DIR* d = opendir(dir);
+  if ( d != NULL ){
+    struct dirent* entry;
+    u64 now = now_ns();
+    while ( (entry = readdir(d)) != NULL )
+      if ( is_p6_name(entry->d_name) ) touch_pending(&pending, entry->d_name, now, 0);
+    closedir(d);
+  }
+  info("watch: %s -> %s with %u workers, debounce %u ms", dir, w.out_dir, threads, opts->debounce_ms);
+
+  char events[WATCH_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+  u64 next_stats = now_ns() + (u64)opts->stats_interval_s * 1000000000;
+
+  while ( !stop_requested ){
+    int timeout = flush_pending(&pending, &w, now_ns());
+    if ( opts->stats_interval_s ){
+      u64 now = now_ns();
+      int until_stats = next_stats > now ? (int)((next_stats - now) / 1000000) + 1 : 0;
+      timeout = timeout < 0 || until_stats < timeout ? until_stats : timeout;
+    }
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    struct timespec wait = {timeout / 1000, (long)(timeout % 1000) * 1000000};
+    int ready = ppoll(&pfd, 1, timeout < 0 ? NULL : &wait, &unblocked);
+    if ( ready < 0 && errno != EINTR ){
+      error("watch: poll failed: %s", strerror(errno));
+      break;
+    }
+
+    if ( ready > 0 ){
+      ssize_t len;
+      while ( (len = read(fd, events, sizeof(events))) > 0 ){
+        u64 now = now_ns();
+        for (char* p = events; p < events + len; ){
+          struct inotify_event* ev = (struct inotify_event*)p;
+          if ( ev->len > 0 && !(ev->mask & IN_ISDIR) && is_p6_name(ev->name) )
+            touch_pending(&pending, ev->name, now, debounce_ns);
+          if ( ev->mask & IN_Q_OVERFLOW ) error("watch: inotify queue overflowed, some events were lost");
+          p += sizeof(struct inotify_event) + ev->len;
+        }
+      }
+    }
+
+    u64 now = now_ns();
+    if ( stats_requested || (opts->stats_interval_s && now >= next_stats) ){
+      print_stats(&w, stats_requested);
+      stats_requested = 0;
+      next_stats = now + (u64)opts->stats_interval_s * 1000000000;
+    }
+  }
+
+  // whatever is still waiting for its quiet period gets encoded before exiting
+  flush_pending(&pending, &w, UINT64_MAX);
+  pthread_mutex_lock(&w.lock);
+  w.stop = true;
+  pthread_cond_broadcast(&w.wake);
+  pthread_mutex_unlock(&w.lock);
+  for (u32 i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+  print_stats(&w, true);
+
+  free(pending.items);
+  free(pending.by_output.slots);
+  free(w.queued.slots);
+  free(w.running.slots);
+  cache_close(&w.cache);
+  close(fd);
+  pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+}
@@ -0,0 +1,16 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "types.h"
+
+struct watch_opts {
+  const char* output_dir; // where .qoi files go, defaults to the watched directory
+  u32 threads;            // encoder workers
+  u32 debounce_ms;        // quiet time after the last event before a file is queued
+  u32 stats_interval_s;   // 0 disables the periodic stats line
+};
+
+// runs until SIGINT/SIGTERM, SIGUSR1 prints the queue and latency stats
+void watch(const char* dir, const struct watch_opts* opts);
+
+#endif